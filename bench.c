@@ -0,0 +1,412 @@
+/*
+ * RSFS - Really Simple File System
+ *
+ * This file is part of RSFS.
+ *
+ * RSFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Benchmark do RSFS: formata uma imagem nova e executa cargas pela API do fs.h, imprimindo um resultado por
+// linha em JSON na saida padrao. As mensagens do fs e do disco vao para a saida de erro, para que a saida
+// padrao tenha apenas resultados;
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fs.h"
+
+#define BENCH_SEQ_MAX (64 * 1024 * 1024)
+#define BENCH_COPY_BUFFER (64 * 1024)
+#define BENCH_FILL_BUFFER (1024 * 1024)
+#define BENCH_CHURN_OPS 2000
+#define BENCH_CHURN_FILES 64
+#define BENCH_CHURN_SIZE 4096
+#define BENCH_APPEND_OPS 5000
+#define BENCH_APPEND_SIZE 100
+#define BENCH_FRAG_FILES 16
+#define BENCH_FRAG_MAX (32 * 1024 * 1024)
+#define BENCH_DEFRAG_STEP 256
+
+// Tamanhos das chamadas de fs_write e fs_read nas cargas sequenciais;
+int call_sizes[] = {512, 4096, 65536, 1048576};
+
+// Medicao de uma carga: a latencia de cada operacao, o tempo total, os bytes transferidos e os contadores
+// do disco no inicio;
+typedef struct {
+  const char *workload;
+  int call_size;
+  long *latencies;
+  int ops;
+  int cap;
+  long bytes;
+  struct timespec start;
+  bl_io_stats io;
+  bl_cache_stats cache;
+} bench_run;
+
+FILE *output;
+char *buffer;
+
+// Funcao auxiliar que devolve o relogio monotonico em nanossegundos;
+long __bench_now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+void __bench_start(bench_run *r, const char *workload, int call_size) {
+  memset(r, 0, sizeof(bench_run));
+  r->workload = workload;
+  r->call_size = call_size;
+  bl_io_get_stats(&r->io);
+  bl_cache_get_stats(&r->cache);
+  clock_gettime(CLOCK_MONOTONIC, &r->start);
+}
+
+// Funcao auxiliar que registra uma operacao que comecou em inicio e transferiu bytes;
+void __bench_op(bench_run *r, long inicio, long bytes) {
+  if (r->ops == r->cap) {
+    int novo = r->cap == 0 ? 1024 : r->cap * 2;
+    long *l = realloc(r->latencies, novo * sizeof(long));
+    if (l == NULL) {
+      perror("Alocando latencias");
+      exit(1);
+    }
+    r->latencies = l;
+    r->cap = novo;
+  }
+  r->latencies[r->ops++] = __bench_now() - inicio;
+  r->bytes += bytes;
+}
+
+int __bench_cmp_long(const void *a, const void *b) {
+  long x = *(long *) a, y = *(long *) b;
+  return (x > y) - (x < y);
+}
+
+// Funcao auxiliar que devolve o percentil p das latencias ja ordenadas, em microssegundos;
+double __bench_percentile(bench_run *r, double p) {
+  if (r->ops == 0) return 0;
+  int i = (int) (p / 100 * (r->ops - 1) + 0.5);
+  return r->latencies[i] / 1000.0;
+}
+
+// Encerra uma carga e imprime a sua linha de resultado, com as diferencas dos contadores do disco;
+void __bench_end(bench_run *r, const char *extra) {
+  struct timespec fim;
+  clock_gettime(CLOCK_MONOTONIC, &fim);
+  double segundos = (fim.tv_sec - r->start.tv_sec) + (fim.tv_nsec - r->start.tv_nsec) / 1e9;
+  bl_io_stats io;
+  bl_cache_stats cache;
+  bl_io_get_stats(&io);
+  bl_cache_get_stats(&cache);
+  qsort(r->latencies, r->ops, sizeof(long), __bench_cmp_long);
+
+  fprintf(output, "{\"workload\":\"%s\",\"call_size\":%d,\"ops\":%d,\"bytes\":%ld,\"seconds\":%.6f,",
+          r->workload, r->call_size, r->ops, r->bytes, segundos);
+  fprintf(output, "\"ops_per_s\":%.1f,\"mb_per_s\":%.2f,", r->ops / segundos, r->bytes / segundos / (1024 * 1024));
+  fprintf(output, "\"lat_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f},",
+          __bench_percentile(r, 50), __bench_percentile(r, 90), __bench_percentile(r, 99),
+          __bench_percentile(r, 99.9), __bench_percentile(r, 100));
+  fprintf(output, "\"bl\":{\"reads\":%ld,\"writes\":%ld,\"sectors_read\":%ld,\"sectors_written\":%ld,\"syncs\":%ld},",
+          io.reads - r->io.reads, io.writes - r->io.writes, io.sectors_read - r->io.sectors_read,
+          io.sectors_written - r->io.sectors_written, io.syncs - r->io.syncs);
+  fprintf(output, "\"cache\":{\"hits\":%ld,\"misses\":%ld,\"writebacks\":%ld}",
+          cache.hits - r->cache.hits, cache.misses - r->cache.misses, cache.writebacks - r->cache.writebacks);
+  if (extra != NULL) fprintf(output, ",%s", extra);
+  fprintf(output, "}\n");
+  fflush(output);
+  free(r->latencies);
+}
+
+// Escrita sequencial de um arquivo de bytes bytes em chamadas de call_size, seguida da leitura dele;
+void bench_sequential(int call_size, long bytes) {
+  bench_run r;
+  int fd;
+
+  __bench_start(&r, "seq_write", call_size);
+  if ((fd = fs_open("seq", FS_W)) == -1) exit(1);
+  for (long feito = 0; feito < bytes; feito += call_size) {
+    long inicio = __bench_now();
+    if (fs_write(buffer, call_size, fd) != call_size) break;
+    __bench_op(&r, inicio, call_size);
+  }
+  fs_close(fd);
+  fs_sync();
+  __bench_end(&r, NULL);
+
+  __bench_start(&r, "seq_read", call_size);
+  if ((fd = fs_open("seq", FS_R)) == -1) exit(1);
+  while (1) {
+    long inicio = __bench_now();
+    int lido = fs_read(buffer, call_size, fd);
+    if (lido <= 0) break;
+    __bench_op(&r, inicio, lido);
+  }
+  fs_close(fd);
+  __bench_end(&r, NULL);
+}
+
+// Rotatividade de arquivos pequenos: cada operacao cria um arquivo de BENCH_CHURN_SIZE bytes e remove o que
+// ocupava a mesma posicao na rodada anterior, mantendo ate BENCH_CHURN_FILES arquivos vivos;
+void bench_churn() {
+  bench_run r;
+  char nome[32];
+
+  __bench_start(&r, "churn", BENCH_CHURN_SIZE);
+  for (int i = 0; i < BENCH_CHURN_OPS; i++) {
+    long inicio = __bench_now();
+    if (i >= BENCH_CHURN_FILES) {
+      sprintf(nome, "churn%d", i - BENCH_CHURN_FILES);
+      fs_remove(nome);
+    }
+    sprintf(nome, "churn%d", i);
+    int fd = fs_open(nome, FS_W);
+    if (fd == -1) break;
+    fs_write(buffer, BENCH_CHURN_SIZE, fd);
+    fs_close(fd);
+    __bench_op(&r, inicio, BENCH_CHURN_SIZE);
+  }
+  fs_sync();
+  __bench_end(&r, NULL);
+  for (int i = BENCH_CHURN_OPS - BENCH_CHURN_FILES; i < BENCH_CHURN_OPS; i++) {
+    sprintf(nome, "churn%d", i);
+    fs_remove(nome);
+  }
+}
+
+// Log: cada operacao abre o arquivo em modo de acrescimo, escreve uma linha de BENCH_APPEND_SIZE bytes e o
+// fecha. Depois, no modo de leitura e escrita, cada operacao troca 4 bytes no cabecalho do log;
+void bench_append() {
+  bench_run r;
+
+  __bench_start(&r, "append", BENCH_APPEND_SIZE);
+  for (int i = 0; i < BENCH_APPEND_OPS; i++) {
+    long inicio = __bench_now();
+    int fd = fs_open("log", FS_A);
+    if (fd == -1) break;
+    fs_write(buffer, BENCH_APPEND_SIZE, fd);
+    fs_close(fd);
+    __bench_op(&r, inicio, BENCH_APPEND_SIZE);
+  }
+  fs_sync();
+  __bench_end(&r, NULL);
+
+  __bench_start(&r, "patch", 4);
+  for (int i = 0; i < BENCH_APPEND_OPS; i++) {
+    long inicio = __bench_now();
+    int fd = fs_open("log", FS_RW);
+    if (fd == -1) break;
+    fs_write((char *) &i, 4, fd);
+    fs_close(fd);
+    __bench_op(&r, inicio, 4);
+  }
+  fs_sync();
+  __bench_end(&r, NULL);
+  fs_remove("log");
+}
+
+// Copia dentro da imagem do arquivo deixado pela carga sequencial, como o comando copy do shell;
+void bench_copy() {
+  bench_run r;
+
+  __bench_start(&r, "copy", BENCH_COPY_BUFFER);
+  int fd1 = fs_open("seq", FS_R);
+  int fd2 = fs_open("seq.copy", FS_W);
+  if (fd1 == -1 || fd2 == -1) exit(1);
+  while (1) {
+    long inicio = __bench_now();
+    int lido = fs_read(buffer, BENCH_COPY_BUFFER, fd1);
+    if (lido <= 0 || fs_write(buffer, lido, fd2) != lido) break;
+    __bench_op(&r, inicio, lido);
+  }
+  fs_close(fd1);
+  fs_close(fd2);
+  fs_sync();
+  __bench_end(&r, NULL);
+  fs_remove("seq.copy");
+}
+
+// Enche o disco com um unico arquivo ate a escrita falhar;
+void bench_fill() {
+  bench_run r;
+  char extra[64];
+
+  __bench_start(&r, "fill", BENCH_FILL_BUFFER);
+  int fd = fs_open("fill", FS_W);
+  if (fd == -1) exit(1);
+  while (1) {
+    long inicio = __bench_now();
+    int escrito = fs_write(buffer, BENCH_FILL_BUFFER, fd);
+    if (escrito <= 0) break;
+    __bench_op(&r, inicio, escrito);
+    if (escrito < BENCH_FILL_BUFFER) break;
+  }
+  fs_close(fd);
+  fs_sync();
+  sprintf(extra, "\"free_after\":%ld", fs_free());
+  __bench_end(&r, extra);
+  fs_remove("fill");
+}
+
+// Funcao auxiliar que le inteiros os arquivos da carga de fragmentacao, medindo cada chamada de fs_read;
+void __bench_read_frag(bench_run *r) {
+  char nome[32];
+  for (int i = 0; i < BENCH_FRAG_FILES; i++) {
+    sprintf(nome, "frag%d", i);
+    int fd = fs_open(nome, FS_R);
+    if (fd == -1) exit(1);
+    while (1) {
+      long inicio = __bench_now();
+      int lido = fs_read(buffer, BENCH_COPY_BUFFER, fd);
+      if (lido <= 0) break;
+      __bench_op(r, inicio, lido);
+    }
+    fs_close(fd);
+  }
+}
+
+// Fragmentacao: BENCH_FRAG_FILES arquivos crescem intercalados, um cluster por vez, e depois cada um e lido
+// inteiro. Cada cluster e acrescentado com o arquivo reaberto em modo de acrescimo, para que a alocacao
+// atrasada nao junte os clusters de um arquivo. O resultado traz as descontinuidades das cadeias que a
+// escrita intercalada deixou. Depois o desfragmentador roda em passos de BENCH_DEFRAG_STEP clusters, cada
+// passo uma operacao, e os arquivos sao lidos de novo;
+void bench_fragmented(long bytes) {
+  bench_run r;
+  char nome[32], extra[96];
+  fs_stats st;
+  fs_frag antes, depois;
+
+  fs_statfs(&st);
+  int passo = st.cluster_size;
+  for (long feito = 0; feito < bytes; feito += (long) passo * BENCH_FRAG_FILES) {
+    for (int i = 0; i < BENCH_FRAG_FILES; i++) {
+      sprintf(nome, "frag%d", i);
+      int fd = fs_open(nome, FS_A);
+      if (fd == -1) exit(1);
+      fs_write(buffer, passo, fd);
+      fs_close(fd);
+    }
+  }
+  fs_sync();
+  fs_statfs(&st);
+  sprintf(extra, "\"fragments\":%d", st.fragments);
+
+  __bench_start(&r, "frag_read", BENCH_COPY_BUFFER);
+  __bench_read_frag(&r);
+  __bench_end(&r, extra);
+
+  fs_fragmentation(NULL, &antes);
+  __bench_start(&r, "defrag", BENCH_DEFRAG_STEP);
+  while (1) {
+    long inicio = __bench_now();
+    int movidos = fs_defrag_step(BENCH_DEFRAG_STEP);
+    if (movidos <= 0) break;
+    __bench_op(&r, inicio, (long) movidos * passo);
+  }
+  fs_sync();
+  fs_fragmentation(NULL, &depois);
+  fs_statfs(&st);
+  sprintf(extra, "\"extents_before\":%ld,\"extents_after\":%ld,\"fragments\":%d", antes.extents, depois.extents,
+          st.fragments);
+  __bench_end(&r, extra);
+
+  __bench_start(&r, "defrag_read", BENCH_COPY_BUFFER);
+  __bench_read_frag(&r);
+  __bench_end(&r, NULL);
+  for (int i = 0; i < BENCH_FRAG_FILES; i++) {
+    sprintf(nome, "frag%d", i);
+    fs_remove(nome);
+  }
+}
+
+int main(int argc, char **argv) {
+  char *image;
+  char *backend;
+  int size_mb = 256;
+  int cluster_kb = FS_CLUSTER_DEFAULT / 1024;
+
+  if (argc < 2 || argc > 4) {
+    printf("Uso: %s imagem [tamanho] [cluster]\n", argv[0]);
+    printf("Onde: imagem é o arquivo da imagem usada no benchmark, recriado e apagado ao final.\n");
+    printf("      tamanho (opcional) é o tamanho da imagem em MB, 256 por padrão.\n");
+    printf("      cluster (opcional) é o tamanho do cluster em KB.\n");
+    exit(0);
+  }
+  image = argv[1];
+  if (argc > 2) size_mb = atoi(argv[2]);
+  if (argc > 3) cluster_kb = atoi(argv[3]);
+
+  // O backend de disco pode ser escolhido pela variavel de ambiente RSFS_BACKEND, como no shell;
+  backend = getenv("RSFS_BACKEND");
+  if (backend != NULL) {
+    if (!strcmp(backend, "stdio")) {
+      bl_set_backend(BL_STDIO);
+    } else if (!strcmp(backend, "mmap")) {
+      bl_set_backend(BL_MMAP);
+    } else if (!strcmp(backend, "pread")) {
+      bl_set_backend(BL_PREAD);
+    } else if (!strcmp(backend, "direct")) {
+      bl_set_backend(BL_DIRECT);
+    }
+  }
+
+  // Os resultados saem pela saida padrao original; o resto das mensagens vai para a saida de erro;
+  output = fdopen(dup(1), "w");
+  if (output == NULL || dup2(2, 1) == -1) {
+    perror("Separando a saida dos resultados");
+    exit(1);
+  }
+
+  buffer = malloc(BENCH_FILL_BUFFER);
+  if (buffer == NULL) {
+    perror("Alocando buffer");
+    exit(1);
+  }
+  memset(buffer, 'r', BENCH_FILL_BUFFER);
+
+  unlink(image);
+  bl_device *dev = bl_open(image, (int) ((long) size_mb * 1024 * 1024 / SECTORSIZE));
+  if (dev == NULL) exit(1);
+  bl_use(dev);
+  fs_mount *mount = fs_mount_device(dev);
+  if (mount == NULL) exit(1);
+  fs_use(mount);
+  if (!fs_format(cluster_kb * 1024)) exit(1);
+
+  long seq = fs_free() / 4;
+  if (seq > BENCH_SEQ_MAX) seq = BENCH_SEQ_MAX;
+  for (int i = 0; i < sizeof(call_sizes) / sizeof(int); i++) {
+    bench_sequential(call_sizes[i], seq);
+  }
+  bench_copy();
+  fs_remove("seq");
+  bench_churn();
+  bench_append();
+  bench_fill();
+  long frag = fs_free() / 2;
+  if (frag > BENCH_FRAG_MAX) frag = BENCH_FRAG_MAX;
+  bench_fragmented(frag);
+
+  fs_unmount(mount);
+  bl_close(dev);
+  unlink(image);
+  free(buffer);
+  fclose(output);
+  return 0;
+}
@@ -20,75 +20,1155 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "disk.h"
 
-int device_size;
-FILE *stream;
+// Quantidade maxima de setores passada ao kernel em uma unica chamada vetorizada;
+#define BL_MAX_IOV 1024
 
-int bl_init(char *file, int size) {
+// Cache de setores entre o fs e a imagem. Cada slot guarda um setor, um bit de referencia
+// usado pelo algoritmo CLOCK e uma marca de sujo para a escrita adiada (write-back).
+// Os slots sao encontrados por uma tabela hash de encadeamento pelo numero do setor.
+// Um slot preenchido por leitura antecipada (bl_prefetch) guarda em tag o pedido assincrono que ainda
+// o esta lendo, ou -1, e fica marcado como prefetched ate ser usado ou descartado;
+typedef struct {
+  int sector;
+  char dirty;
+  char ref;
+  char prefetched;
+  int tag;
+  int next;
+  char *data;
+} cache_slot;
+
+// Motor de E/S assincrona. Cada pedido ocupa um slot da tabela aio, que cresce conforme a demanda,
+// ate que quem o submeteu o recolha com bl_wait. Os pedidos ficam numa fila encadeada atendida por
+// aio_depth threads trabalhadoras, de forma que ate aio_depth operacoes ficam em voo ao mesmo tempo;
+#define AIO_FREE 0
+#define AIO_QUEUED 1
+#define AIO_RUNNING 2
+#define AIO_DONE 3
+
+typedef struct {
+  int state;
+  int write;
+  int sector;
+  int count;
+  char *buffer;
+  int result;
+  int next;
+} aio_request;
+
+// Um dispositivo e uma imagem aberta com todo o seu estado: backend, cache de setores e motor assincrono.
+// No BL_MMAP a imagem inteira e mapeada em memoria e os setores sao lidos e escritos com memcpy sobre o
+// mapeamento. No BL_PREAD e no BL_DIRECT usamos um descritor com pread/pwrite, que nao dependem de uma
+// posicao compartilhada; o BL_DIRECT ainda abre a imagem com O_DIRECT, exigindo buffers alinhados, e usa
+// bounce quando o buffer recebido nao esta alinhado.
+// A cache e protegida por lock, que nao fica preso durante as leituras e escritas vetorizadas direto na
+// imagem. O io_lock serializa apenas o que depende de estado compartilhado do backend: a posicao do stream
+// no BL_STDIO e o buffer bounce no BL_DIRECT;
+struct bl_device {
+  off_t device_size;
+  FILE *stream;
+  int backend;
+  char *mapping;
+  int fd;
+  char *bounce;
+  pthread_mutex_t lock;
+  pthread_mutex_t io_lock;
+
+  cache_slot *cache;
+  char *cache_data;
+  int cache_capacity;
+  int *cache_buckets;
+  int cache_nbuckets;
+  int cache_hand;
+  bl_cache_stats cache_stats;
+  bl_io_stats io_stats;
+
+  aio_request *aio;
+  int aio_slots;
+  int aio_depth;
+  int aio_head;
+  int aio_tail;
+  int aio_stop;
+  pthread_t *aio_workers;
+  pthread_mutex_t aio_lock;
+  pthread_mutex_t aio_start;
+  pthread_cond_t aio_work;
+  pthread_cond_t aio_done;
+};
+
+// Backend usado pelo proximo bl_open;
+int backend_choice = BL_PREAD;
+
+// Cada thread trabalha sobre o dispositivo escolhido com bl_use; sem escolha vale o do ultimo bl_init;
+__thread bl_device *current_device;
+bl_device *default_device;
+
+int __bl_dev_write(bl_device *d, int sector, char *buffer);
+int __bl_dev_read(bl_device *d, int sector, char *buffer);
+int __bl_aio_enqueue(bl_device *d, int write, int sector, int count, char *buffer);
+int __bl_sync(bl_device *d);
+int __bl_wait(bl_device *d, int tag);
+void __bl_aio_shutdown(bl_device *d);
+
+// Funcao auxiliar que devolve o dispositivo da thread atual;
+bl_device *__bl_current() {
+  return current_device != NULL ? current_device : default_device;
+}
+
+bl_device *bl_open(char *file, int size) {
   struct stat sb;
 
-  stream = NULL;
+  bl_device *d = calloc(1, sizeof(bl_device));
+  if (d == NULL) {
+    perror("Alocando dispositivo");
+    return NULL;
+  }
+  d->backend = backend_choice;
+  d->fd = -1;
+  d->aio_head = -1;
+  d->aio_tail = -1;
+  pthread_mutex_init(&d->lock, NULL);
+  pthread_mutex_init(&d->io_lock, NULL);
+  pthread_mutex_init(&d->aio_lock, NULL);
+  pthread_mutex_init(&d->aio_start, NULL);
+  pthread_cond_init(&d->aio_work, NULL);
+  pthread_cond_init(&d->aio_done, NULL);
+
   if (stat(file, &sb) == 0) {
     if (S_ISREG(sb.st_mode)) {
-      device_size = sb.st_size;
-      stream = fopen(file, "r+");
+      d->device_size = sb.st_size;
+      d->stream = fopen(file, "r+");
     }
-    if (stream == NULL) {
+    if (d->stream == NULL) {
       perror("Abrindo imagem pré-existente");
-      return 0;
+      bl_close(d);
+      return NULL;
     }
   } else {
-    device_size = size * SECTORSIZE;
-    if (device_size < 1) {
+    d->device_size = (off_t) size * SECTORSIZE;
+    if (d->device_size < 1) {
       printf("Imagem não pode ter tamanho zero\n");
-      return 0;
+      bl_close(d);
+      return NULL;
     }
-    stream = fopen(file, "w+");
-    if (stream == NULL) {
+    d->stream = fopen(file, "w+");
+    if (d->stream == NULL) {
       perror("Criando nova imagem");
-      return 0;
+      bl_close(d);
+      return NULL;
     }
-    if (truncate(file, device_size) == -1) {
+    if (truncate(file, d->device_size) == -1) {
       perror("Ajustando tamanho da imagem");
-      return 0;
+      bl_close(d);
+      return NULL;
+    }
+  }
+
+  int capacidade = BL_CACHE_DEFAULT;
+  if (d->backend == BL_MMAP) {
+    d->mapping = mmap(NULL, d->device_size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(d->stream), 0);
+    if (d->mapping == MAP_FAILED) {
+      perror("Mapeando imagem em memória");
+      d->mapping = NULL;
+      bl_close(d);
+      return NULL;
+    }
+    // O mapeamento ja serve de cache, entao nao duplicamos os setores na cache de setores;
+    capacidade = 0;
+  }
+
+  if (d->backend == BL_PREAD || d->backend == BL_DIRECT) {
+    int flags = O_RDWR;
+    if (d->backend == BL_DIRECT) flags |= O_DIRECT;
+    d->fd = open(file, flags);
+    if (d->fd == -1 && d->backend == BL_DIRECT && errno == EINVAL) {
+      // Alguns sistemas de arquivos (tmpfs, por exemplo) nao aceitam O_DIRECT;
+      printf("O_DIRECT não suportado para a imagem, usando pread/pwrite comum\n");
+      d->backend = BL_PREAD;
+      d->fd = open(file, O_RDWR);
+    }
+    if (d->fd == -1) {
+      perror("Abrindo descritor da imagem");
+      bl_close(d);
+      return NULL;
+    }
+    fclose(d->stream);
+    d->stream = NULL;
+    if (d->backend == BL_DIRECT && posix_memalign((void **) &d->bounce, SECTORSIZE, SECTORSIZE) != 0) {
+      printf("Erro alocando buffer alinhado\n");
+      bl_close(d);
+      return NULL;
     }
   }
-  return 1; 
+
+  bl_device *anterior = current_device;
+  current_device = d;
+  int ok = bl_cache_init(capacidade);
+  current_device = anterior;
+  if (!ok) {
+    bl_close(d);
+    return NULL;
+  }
+  return d;
+}
+
+int bl_close(bl_device *d) {
+  // Escreve o que esta adiado na cache, encerra as trabalhadoras e libera o dispositivo;
+  int ok = 1;
+  pthread_mutex_lock(&d->lock);
+  for (int i = 0; i < d->cache_capacity; i++) {
+    if (d->cache[i].sector != -1 && d->cache[i].tag != -1) {
+      __bl_wait(d, d->cache[i].tag);
+      d->cache[i].tag = -1;
+    }
+  }
+  if (d->stream != NULL || d->fd != -1 || d->mapping != NULL) ok = __bl_sync(d);
+  pthread_mutex_unlock(&d->lock);
+  __bl_aio_shutdown(d);
+
+  if (d->mapping != NULL) munmap(d->mapping, d->device_size);
+  if (d->stream != NULL) fclose(d->stream);
+  if (d->fd != -1) close(d->fd);
+  free(d->bounce);
+  free(d->cache);
+  free(d->cache_data);
+  free(d->cache_buckets);
+  free(d->aio);
+  pthread_mutex_destroy(&d->lock);
+  pthread_mutex_destroy(&d->io_lock);
+  pthread_mutex_destroy(&d->aio_lock);
+  pthread_mutex_destroy(&d->aio_start);
+  pthread_cond_destroy(&d->aio_work);
+  pthread_cond_destroy(&d->aio_done);
+  if (current_device == d) current_device = NULL;
+  if (default_device == d) default_device = NULL;
+  free(d);
+  return ok;
+}
+
+void bl_use(bl_device *d) {
+  current_device = d;
+}
+
+bl_device *bl_current() {
+  return __bl_current();
+}
+
+int bl_init(char *file, int size) {
+  // Abre a imagem como dispositivo padrao do processo e da thread atual;
+  bl_device *d = bl_open(file, size);
+  if (d == NULL) return 0;
+  default_device = d;
+  current_device = d;
+  return 1;
+}
+
+int bl_set_backend(int kind) {
+  if (kind != BL_STDIO && kind != BL_MMAP && kind != BL_PREAD && kind != BL_DIRECT) {
+    printf("Backend de disco não suportado\n");
+    return 0;
+  }
+  backend_choice = kind;
+  return 1;
 }
 
 int bl_size() {
-  return device_size / SECTORSIZE;
+  return (int) (__bl_current()->device_size / SECTORSIZE);
 }
 
-int bl_write(int sector, char *buffer) {
-  if (fseek(stream, sector * SECTORSIZE, SEEK_SET) == -1) {
+// Funcao auxiliar que devolve o relogio monotonico em nanossegundos, usado nos histogramas de latencia;
+long __bl_clock() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+void bl_histogram_add(bl_histogram *h, long value) {
+  // O balde e a posicao do bit mais alto do valor;
+  int balde = 0;
+  while (balde < BL_HIST_BUCKETS - 1 && (value >> (balde + 1)) > 0) balde++;
+  __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->buckets[balde], 1, __ATOMIC_RELAXED);
+}
+
+long bl_histogram_percentile(bl_histogram *h, double p) {
+  // Devolvemos o limite superior do balde onde cai o percentil pedido;
+  long alvo = (long) (p / 100 * h->count + 0.5);
+  long visto = 0;
+  if (h->count == 0) return 0;
+  if (alvo < 1) alvo = 1;
+  for (int i = 0; i < BL_HIST_BUCKETS; i++) {
+    visto += h->buckets[i];
+    if (visto >= alvo) return (2L << i) - 1;
+  }
+  return (2L << (BL_HIST_BUCKETS - 1)) - 1;
+}
+
+// Funcao auxiliar que copia contadores atualizados atomicamente, lidos um a um, ou os zera se src e NULL;
+void __bl_counters_copy(long *dst, long *src, int n) {
+  for (int i = 0; i < n; i++) {
+    if (src == NULL) {
+      __atomic_store_n(&dst[i], 0, __ATOMIC_RELAXED);
+    } else {
+      dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// Funcao auxiliar que registra uma operacao de setores setores na imagem, iniciada em inicio. As operacoes
+// na imagem acontecem com e sem o lock da cache, entao os contadores sao atualizados atomicamente;
+void __bl_io_done(bl_device *d, int escrita, long setores, long inicio) {
+  long latencia = __bl_clock() - inicio;
+  if (escrita) {
+    __atomic_fetch_add(&d->io_stats.writes, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&d->io_stats.sectors_written, setores, __ATOMIC_RELAXED);
+    bl_histogram_add(&d->io_stats.write_latency, latencia);
+  } else {
+    __atomic_fetch_add(&d->io_stats.reads, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&d->io_stats.sectors_read, setores, __ATOMIC_RELAXED);
+    bl_histogram_add(&d->io_stats.read_latency, latencia);
+  }
+}
+
+// Funcao auxiliar que escreve um setor na imagem, pelo backend do dispositivo;
+int __bl_image_write(bl_device *d, int sector, char *buffer) {
+  if (d->backend == BL_MMAP) {
+    memcpy(d->mapping + (size_t) sector * SECTORSIZE, buffer, SECTORSIZE);
+    return 1;
+  }
+  if (d->backend == BL_PREAD || d->backend == BL_DIRECT) {
+    // No O_DIRECT o buffer precisa estar alinhado, senao passamos pelo buffer alinhado;
+    int alinhado = d->backend != BL_DIRECT || ((size_t) buffer % SECTORSIZE) == 0;
+    if (!alinhado) {
+      pthread_mutex_lock(&d->io_lock);
+      memcpy(d->bounce, buffer, SECTORSIZE);
+      buffer = d->bounce;
+    }
+    int ok = pwrite(d->fd, buffer, SECTORSIZE, (off_t) sector * SECTORSIZE) == SECTORSIZE;
+    if (!alinhado) pthread_mutex_unlock(&d->io_lock);
+    if (!ok) {
+      perror("Erro escrevendo setor");
+      return 0;
+    }
+    return 1;
+  }
+  pthread_mutex_lock(&d->io_lock);
+  if (fseek(d->stream, (long) sector * SECTORSIZE, SEEK_SET) == -1) {
+    pthread_mutex_unlock(&d->io_lock);
     perror("Erro posicionando setor para escrita");
     return 0;
   }
-  if (fwrite(buffer, sizeof(char), SECTORSIZE, stream) != SECTORSIZE) {
+  if (fwrite(buffer, sizeof(char), SECTORSIZE, d->stream) != SECTORSIZE) {
+    pthread_mutex_unlock(&d->io_lock);
     perror("Erro escrevendo setor");
     return 0;
   }
-  if (fflush(stream) != 0) {
-    perror("Erro gravando setor no disco");
-    return 0;
-  }
+  pthread_mutex_unlock(&d->io_lock);
   return 1;
 }
 
-int bl_read(int sector, char *buffer){
-  if (fseek(stream, sector * SECTORSIZE, SEEK_SET) == -1) {
+// Funcao auxiliar que le um setor da imagem, pelo backend do dispositivo;
+int __bl_image_read(bl_device *d, int sector, char *buffer) {
+  if (d->backend == BL_MMAP) {
+    memcpy(buffer, d->mapping + (size_t) sector * SECTORSIZE, SECTORSIZE);
+    return 1;
+  }
+  if (d->backend == BL_PREAD || d->backend == BL_DIRECT) {
+    char *destino = buffer;
+    if (d->backend == BL_DIRECT && ((size_t) buffer % SECTORSIZE) != 0) {
+      pthread_mutex_lock(&d->io_lock);
+      destino = d->bounce;
+    }
+    int ok = pread(d->fd, destino, SECTORSIZE, (off_t) sector * SECTORSIZE) == SECTORSIZE;
+    if (destino != buffer) {
+      if (ok) memcpy(buffer, destino, SECTORSIZE);
+      pthread_mutex_unlock(&d->io_lock);
+    }
+    if (!ok) {
+      perror("Erro lendo setor");
+      return 0;
+    }
+    return 1;
+  }
+  pthread_mutex_lock(&d->io_lock);
+  if (fseek(d->stream, (long) sector * SECTORSIZE, SEEK_SET) == -1) {
+    pthread_mutex_unlock(&d->io_lock);
     perror("Erro posicionando setor para leitura");
     return 0;
   }
-  if (fread(buffer, sizeof(char), SECTORSIZE, stream) != SECTORSIZE) {
+  if (fread(buffer, sizeof(char), SECTORSIZE, d->stream) != SECTORSIZE) {
+    pthread_mutex_unlock(&d->io_lock);
     perror("Erro lendo setor");
     return 0;
   }
+  pthread_mutex_unlock(&d->io_lock);
+  return 1;
+}
+
+int __bl_dev_write(bl_device *d, int sector, char *buffer) {
+  long inicio = __bl_clock();
+  int ok = __bl_image_write(d, sector, buffer);
+  __bl_io_done(d, 1, 1, inicio);
+  return ok;
+}
+
+int __bl_dev_read(bl_device *d, int sector, char *buffer) {
+  long inicio = __bl_clock();
+  int ok = __bl_image_read(d, sector, buffer);
+  __bl_io_done(d, 0, 1, inicio);
+  return ok;
+}
+
+// Funcao auxiliar que verifica se todos os buffers estao alinhados, como o O_DIRECT exige;
+int __bl_aligned(int count, char **buffers) {
+  for (int i = 0; i < count; i++) {
+    if (((size_t) buffers[i] % SECTORSIZE) != 0) return 0;
+  }
+  return 1;
+}
+
+// Funcao auxiliar que le count setores contiguos da imagem, a partir de sector, para buffers espalhados.
+// Nos backends de descritor isso vira um unico preadv por ate BL_MAX_IOV setores;
+int __bl_dev_readv(bl_device *d, int sector, int count, char **buffers) {
+  if (d->backend == BL_STDIO || (d->backend == BL_DIRECT && !__bl_aligned(count, buffers))) {
+    for (int i = 0; i < count; i++) {
+      if (!__bl_dev_read(d, sector + i, buffers[i])) return 0;
+    }
+    return 1;
+  }
+  if (d->backend == BL_MMAP) {
+    long inicio = __bl_clock();
+    for (int i = 0; i < count; i++) {
+      memcpy(buffers[i], d->mapping + (size_t) (sector + i) * SECTORSIZE, SECTORSIZE);
+    }
+    __bl_io_done(d, 0, count, inicio);
+    return 1;
+  }
+
+  struct iovec iov[BL_MAX_IOV];
+  for (int feito = 0; feito < count; ) {
+    int n = count - feito;
+    if (n > BL_MAX_IOV) n = BL_MAX_IOV;
+    for (int i = 0; i < n; i++) {
+      iov[i].iov_base = buffers[feito + i];
+      iov[i].iov_len = SECTORSIZE;
+    }
+    long inicio = __bl_clock();
+    ssize_t lido = preadv(d->fd, iov, n, (off_t) (sector + feito) * SECTORSIZE);
+    __bl_io_done(d, 0, n, inicio);
+    if (lido != (ssize_t) n * SECTORSIZE) {
+      perror("Erro lendo setores");
+      return 0;
+    }
+    feito += n;
+  }
+  return 1;
+}
+
+// Funcao auxiliar que escreve count setores contiguos na imagem, a partir de sector, vindos de buffers espalhados;
+int __bl_dev_writev(bl_device *d, int sector, int count, char **buffers) {
+  if (d->backend == BL_STDIO || (d->backend == BL_DIRECT && !__bl_aligned(count, buffers))) {
+    for (int i = 0; i < count; i++) {
+      if (!__bl_dev_write(d, sector + i, buffers[i])) return 0;
+    }
+    return 1;
+  }
+  if (d->backend == BL_MMAP) {
+    long inicio = __bl_clock();
+    for (int i = 0; i < count; i++) {
+      memcpy(d->mapping + (size_t) (sector + i) * SECTORSIZE, buffers[i], SECTORSIZE);
+    }
+    __bl_io_done(d, 1, count, inicio);
+    return 1;
+  }
+
+  struct iovec iov[BL_MAX_IOV];
+  for (int feito = 0; feito < count; ) {
+    int n = count - feito;
+    if (n > BL_MAX_IOV) n = BL_MAX_IOV;
+    for (int i = 0; i < n; i++) {
+      iov[i].iov_base = buffers[feito + i];
+      iov[i].iov_len = SECTORSIZE;
+    }
+    long inicio = __bl_clock();
+    ssize_t escrito = pwritev(d->fd, iov, n, (off_t) (sector + feito) * SECTORSIZE);
+    __bl_io_done(d, 1, n, inicio);
+    if (escrito != (ssize_t) n * SECTORSIZE) {
+      perror("Erro escrevendo setores");
+      return 0;
+    }
+    feito += n;
+  }
   return 1;
 }
+
+// Funcao auxiliar que procura um setor na cache, retornando o slot ou -1. As funcoes auxiliares da cache
+// devem ser chamadas com o lock do dispositivo;
+int __bl_cache_lookup(bl_device *d, int sector) {
+  int slot = d->cache_buckets[sector & (d->cache_nbuckets - 1)];
+  while (slot != -1 && d->cache[slot].sector != sector) {
+    slot = d->cache[slot].next;
+  }
+  return slot;
+}
+
+// Funcao auxiliar que retira um slot da sua cadeia na tabela hash;
+void __bl_cache_unhash(bl_device *d, int slot) {
+  int *link = &d->cache_buckets[d->cache[slot].sector & (d->cache_nbuckets - 1)];
+  while (*link != slot) {
+    link = &d->cache[*link].next;
+  }
+  *link = d->cache[slot].next;
+  d->cache[slot].sector = -1;
+}
+
+// Funcao auxiliar que escolhe um slot para receber um novo setor usando o algoritmo CLOCK:
+// o ponteiro gira pelos slots dando uma segunda chance a quem tem o bit de referencia ligado.
+// Se a vitima estiver suja ela e escrita na imagem antes de ser reaproveitada;
+int __bl_cache_victim(bl_device *d, int sector) {
+  while (d->cache[d->cache_hand].sector != -1 && d->cache[d->cache_hand].ref) {
+    d->cache[d->cache_hand].ref = 0;
+    d->cache_hand = (d->cache_hand + 1) % d->cache_capacity;
+  }
+  int slot = d->cache_hand;
+  d->cache_hand = (d->cache_hand + 1) % d->cache_capacity;
+
+  if (d->cache[slot].sector != -1) {
+    // Uma leitura antecipada ainda em voo precisa terminar antes de reaproveitarmos o buffer,
+    // e se ela nunca foi usada contamos como desperdicio;
+    if (d->cache[slot].tag != -1) {
+      __bl_wait(d, d->cache[slot].tag);
+      d->cache[slot].tag = -1;
+    }
+    if (d->cache[slot].prefetched) {
+      d->cache[slot].prefetched = 0;
+      d->cache_stats.prefetch_wasted++;
+    }
+    if (d->cache[slot].dirty) {
+      if (!__bl_dev_write(d, d->cache[slot].sector, d->cache[slot].data)) return -1;
+      d->cache_stats.writebacks++;
+    }
+    __bl_cache_unhash(d, slot);
+    d->cache_stats.evictions++;
+  }
+
+  int bucket = sector & (d->cache_nbuckets - 1);
+  d->cache[slot].sector = sector;
+  d->cache[slot].dirty = 0;
+  d->cache[slot].ref = 1;
+  d->cache[slot].prefetched = 0;
+  d->cache[slot].tag = -1;
+  d->cache[slot].next = d->cache_buckets[bucket];
+  d->cache_buckets[bucket] = slot;
+  return slot;
+}
+
+// Funcao auxiliar chamada antes de usar o conteudo de um slot encontrado na cache. Se ele ainda
+// esta sendo lido por uma leitura antecipada esperamos ela terminar. Quando o acesso e uma leitura,
+// o primeiro uso de um slot antecipado conta como acerto da leitura antecipada;
+int __bl_cache_ready(bl_device *d, int slot, int leitura) {
+  if (d->cache[slot].tag != -1) {
+    int result = __bl_wait(d, d->cache[slot].tag);
+    d->cache[slot].tag = -1;
+    if (!result) {
+      d->cache[slot].prefetched = 0;
+      __bl_cache_unhash(d, slot);
+      return 0;
+    }
+  }
+  if (d->cache[slot].prefetched) {
+    d->cache[slot].prefetched = 0;
+    if (leitura) d->cache_stats.prefetch_used++;
+  }
+  d->cache[slot].ref = 1;
+  return 1;
+}
+
+int bl_cache_init(int capacity) {
+  bl_device *d = __bl_current();
+  pthread_mutex_lock(&d->lock);
+
+  // Antes de trocar a cache, esperamos as leituras antecipadas e esvaziamos a antiga;
+  for (int i = 0; i < d->cache_capacity; i++) {
+    if (d->cache[i].sector != -1 && d->cache[i].tag != -1) __bl_cache_ready(d, i, 0);
+  }
+  if (!__bl_sync(d)) {
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+  }
+  free(d->cache);
+  free(d->cache_data);
+  free(d->cache_buckets);
+  d->cache = NULL;
+  d->cache_data = NULL;
+  d->cache_buckets = NULL;
+  d->cache_capacity = 0;
+  memset(&d->cache_stats, 0, sizeof(d->cache_stats));
+
+  // Capacidade zero desliga a cache e os acessos vao direto para a imagem;
+  if (capacity <= 0) {
+    pthread_mutex_unlock(&d->lock);
+    return 1;
+  }
+
+  d->cache_nbuckets = 1;
+  while (d->cache_nbuckets < capacity) d->cache_nbuckets <<= 1;
+  d->cache = malloc(capacity * sizeof(cache_slot));
+  // Os setores da cache ficam alinhados para que o BL_DIRECT possa usa-los sem copia extra;
+  if (posix_memalign((void **) &d->cache_data, SECTORSIZE, (size_t) capacity * SECTORSIZE) != 0) d->cache_data = NULL;
+  d->cache_buckets = malloc(d->cache_nbuckets * sizeof(int));
+  if (d->cache == NULL || d->cache_data == NULL || d->cache_buckets == NULL) {
+    perror("Alocando cache de setores");
+    free(d->cache);
+    free(d->cache_data);
+    free(d->cache_buckets);
+    d->cache = NULL;
+    d->cache_data = NULL;
+    d->cache_buckets = NULL;
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+  }
+  for (int i = 0; i < capacity; i++) {
+    d->cache[i].sector = -1;
+    d->cache[i].dirty = 0;
+    d->cache[i].ref = 0;
+    d->cache[i].prefetched = 0;
+    d->cache[i].tag = -1;
+    d->cache[i].next = -1;
+    d->cache[i].data = d->cache_data + (size_t) i * SECTORSIZE;
+  }
+  for (int i = 0; i < d->cache_nbuckets; i++) {
+    d->cache_buckets[i] = -1;
+  }
+  d->cache_capacity = capacity;
+  d->cache_hand = 0;
+  pthread_mutex_unlock(&d->lock);
+  return 1;
+}
+
+void bl_cache_get_stats(bl_cache_stats *stats) {
+  bl_device *d = __bl_current();
+  pthread_mutex_lock(&d->lock);
+  *stats = d->cache_stats;
+  pthread_mutex_unlock(&d->lock);
+}
+
+void bl_io_get_stats(bl_io_stats *stats) {
+  bl_device *d = __bl_current();
+  __bl_counters_copy((long *) stats, (long *) &d->io_stats, sizeof(bl_io_stats) / sizeof(long));
+}
+
+void bl_io_reset_stats() {
+  // Zera os contadores de operacoes na imagem e os da cache de setores;
+  bl_device *d = __bl_current();
+  __bl_counters_copy((long *) &d->io_stats, NULL, sizeof(bl_io_stats) / sizeof(long));
+  pthread_mutex_lock(&d->lock);
+  memset(&d->cache_stats, 0, sizeof(bl_cache_stats));
+  pthread_mutex_unlock(&d->lock);
+}
+
+int bl_write(int sector, char *buffer) {
+  bl_device *d = __bl_current();
+  if (d->cache_capacity == 0) return __bl_dev_write(d, sector, buffer);
+
+  // O setor inteiro e sobrescrito, entao nao precisamos le-lo da imagem numa falta;
+  pthread_mutex_lock(&d->lock);
+  int slot = __bl_cache_lookup(d, sector);
+  if (slot != -1 && __bl_cache_ready(d, slot, 0)) {
+    d->cache_stats.hits++;
+  } else {
+    d->cache_stats.misses++;
+    slot = __bl_cache_victim(d, sector);
+    if (slot == -1) {
+      pthread_mutex_unlock(&d->lock);
+      return 0;
+    }
+  }
+  memcpy(d->cache[slot].data, buffer, SECTORSIZE);
+  d->cache[slot].dirty = 1;
+  d->cache[slot].ref = 1;
+  pthread_mutex_unlock(&d->lock);
+  return 1;
+}
+
+int bl_read(int sector, char *buffer) {
+  bl_device *d = __bl_current();
+  if (d->cache_capacity == 0) return __bl_dev_read(d, sector, buffer);
+
+  pthread_mutex_lock(&d->lock);
+  int slot = __bl_cache_lookup(d, sector);
+  if (slot != -1 && __bl_cache_ready(d, slot, 1)) {
+    d->cache_stats.hits++;
+  } else {
+    d->cache_stats.misses++;
+    slot = __bl_cache_victim(d, sector);
+    if (slot == -1) {
+      pthread_mutex_unlock(&d->lock);
+      return 0;
+    }
+    if (!__bl_dev_read(d, sector, d->cache[slot].data)) {
+      __bl_cache_unhash(d, slot);
+      pthread_mutex_unlock(&d->lock);
+      return 0;
+    }
+  }
+  memcpy(buffer, d->cache[slot].data, SECTORSIZE);
+  d->cache[slot].ref = 1;
+  pthread_mutex_unlock(&d->lock);
+  return 1;
+}
+
+// Funcao auxiliar de leitura vetorizada sobre um dispositivo. Setores presentes na cache saem dela; as
+// sequencias de faltas sao lidas da imagem de uma vez, direto para os buffers de destino e sem ocupar a cache,
+// ja que acessos em faixa costumam ser sequenciais. O lock da cache e solto durante a leitura da imagem;
+int __bl_readv(bl_device *d, int sector, int count, char **buffers) {
+  if (d->cache_capacity == 0) return __bl_dev_readv(d, sector, count, buffers);
+
+  pthread_mutex_lock(&d->lock);
+  int i = 0;
+  while (i < count) {
+    int slot = __bl_cache_lookup(d, sector + i);
+    if (slot != -1) {
+      if (!__bl_cache_ready(d, slot, 1)) {
+        pthread_mutex_unlock(&d->lock);
+        return 0;
+      }
+      memcpy(buffers[i], d->cache[slot].data, SECTORSIZE);
+      d->cache_stats.hits++;
+      i++;
+      continue;
+    }
+    int j = i + 1;
+    while (j < count && __bl_cache_lookup(d, sector + j) == -1) j++;
+    d->cache_stats.misses += j - i;
+    pthread_mutex_unlock(&d->lock);
+    if (!__bl_dev_readv(d, sector + i, j - i, buffers + i)) return 0;
+    pthread_mutex_lock(&d->lock);
+    i = j;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return 1;
+}
+
+int bl_readv(int sector, int count, char **buffers) {
+  return __bl_readv(__bl_current(), sector, count, buffers);
+}
+
+// Funcao auxiliar que atualiza as copias na cache de uma faixa que vai ser escrita direto na imagem.
+// Como a imagem passa a ter o mesmo conteudo, elas deixam de estar sujas;
+void __bl_cache_refresh(bl_device *d, int sector, int count, char **buffers) {
+  if (d->cache_capacity == 0) return;
+  pthread_mutex_lock(&d->lock);
+  for (int i = 0; i < count; i++) {
+    int slot = __bl_cache_lookup(d, sector + i);
+    if (slot != -1 && __bl_cache_ready(d, slot, 0)) {
+      memcpy(d->cache[slot].data, buffers[i], SECTORSIZE);
+      d->cache[slot].dirty = 0;
+    }
+  }
+  pthread_mutex_unlock(&d->lock);
+}
+
+// Funcao auxiliar que volta a marcar como sujas as copias na cache de uma faixa cuja escrita direta falhou,
+// para que o bl_sync tente grava-las de novo e informe o erro;
+void __bl_cache_redirty(bl_device *d, int sector, int count) {
+  if (d->cache_capacity == 0) return;
+  pthread_mutex_lock(&d->lock);
+  for (int i = 0; i < count; i++) {
+    int slot = __bl_cache_lookup(d, sector + i);
+    if (slot != -1 && __bl_cache_ready(d, slot, 0)) d->cache[slot].dirty = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+}
+
+int bl_writev(int sector, int count, char **buffers) {
+  // A faixa vai direto para a imagem em uma escrita, depois de atualizar as copias presentes na cache. Elas
+  // sao atualizadas antes para que um bl_sync no meio nao grave uma copia velha por cima da escrita;
+  bl_device *d = __bl_current();
+  __bl_cache_refresh(d, sector, count, buffers);
+  if (__bl_dev_writev(d, sector, count, buffers)) return 1;
+  __bl_cache_redirty(d, sector, count);
+  return 0;
+}
+
+// Funcao auxiliar que monta a lista de buffers de uma faixa contigua de memoria e chama a versao vetorizada;
+int __bl_range(int sector, int count, char *buffer, int escrita) {
+  char *buffers[BL_MAX_IOV];
+  for (int feito = 0; feito < count; ) {
+    int n = count - feito;
+    if (n > BL_MAX_IOV) n = BL_MAX_IOV;
+    for (int i = 0; i < n; i++) {
+      buffers[i] = buffer + (size_t) (feito + i) * SECTORSIZE;
+    }
+    if (escrita ? !bl_writev(sector + feito, n, buffers) : !bl_readv(sector + feito, n, buffers)) return 0;
+    feito += n;
+  }
+  return 1;
+}
+
+int bl_read_range(int sector, int count, char *buffer) {
+  return __bl_range(sector, count, buffer, 0);
+}
+
+int bl_write_range(int sector, int count, char *buffer) {
+  return __bl_range(sector, count, buffer, 1);
+}
+
+// Funcao auxiliar de ordenacao dos slots sujos de um dispositivo pelo numero do setor;
+int __bl_cmp_slot(const void *a, const void *b, void *arg) {
+  bl_device *d = arg;
+  return d->cache[*(int *) a].sector - d->cache[*(int *) b].sector;
+}
+
+// Funcao auxiliar do bl_sync, chamada com o lock da cache;
+int __bl_sync(bl_device *d) {
+  // Escreve na imagem todos os setores sujos da cache. Eles sao ordenados pelo setor e cada sequencia
+  // de setores contiguos vai para a imagem em uma unica escrita vetorizada;
+  int *sujos = malloc((d->cache_capacity > 0 ? d->cache_capacity : 1) * sizeof(int));
+  char **buffers = malloc((d->cache_capacity > 0 ? d->cache_capacity : 1) * sizeof(char *));
+  if (sujos == NULL || buffers == NULL) {
+    free(sujos);
+    free(buffers);
+    perror("Alocando lista de setores sujos");
+    return 0;
+  }
+  int n = 0;
+  for (int i = 0; i < d->cache_capacity; i++) {
+    if (d->cache[i].sector != -1 && d->cache[i].dirty) sujos[n++] = i;
+  }
+  qsort_r(sujos, n, sizeof(int), __bl_cmp_slot, d);
+  for (int i = 0; i < n; ) {
+    int j = i;
+    while (j < n && d->cache[sujos[j]].sector == d->cache[sujos[i]].sector + (j - i)) {
+      buffers[j - i] = d->cache[sujos[j]].data;
+      j++;
+    }
+    if (!__bl_dev_writev(d, d->cache[sujos[i]].sector, j - i, buffers)) {
+      free(sujos);
+      free(buffers);
+      return 0;
+    }
+    for (int k = i; k < j; k++) {
+      d->cache[sujos[k]].dirty = 0;
+    }
+    d->cache_stats.writebacks += j - i;
+    i = j;
+  }
+  free(sujos);
+  free(buffers);
+
+  // Barreira de durabilidade: o que foi escrito ate aqui so e considerado no disco depois dela.
+  // No backend mmap as paginas modificadas chegam ao arquivo com o msync, nos demais com o fdatasync;
+  long inicio = __bl_clock();
+  int ok = 1;
+  if (d->backend == BL_MMAP) {
+    if (msync(d->mapping, d->device_size, MS_SYNC) == -1) {
+      perror("Sincronizando imagem mapeada");
+      ok = 0;
+    }
+  } else if (d->backend == BL_STDIO) {
+    pthread_mutex_lock(&d->io_lock);
+    ok = d->stream == NULL || (fflush(d->stream) == 0 && fdatasync(fileno(d->stream)) != -1);
+    pthread_mutex_unlock(&d->io_lock);
+    if (!ok) perror("Erro gravando setores no disco");
+  } else if (d->fd != -1 && fdatasync(d->fd) == -1) {
+    perror("Erro gravando setores no disco");
+    ok = 0;
+  }
+  __atomic_fetch_add(&d->io_stats.syncs, 1, __ATOMIC_RELAXED);
+  bl_histogram_add(&d->io_stats.sync_latency, __bl_clock() - inicio);
+  return ok;
+}
+
+int bl_sync() {
+  bl_device *d = __bl_current();
+  pthread_mutex_lock(&d->lock);
+  int ok = __bl_sync(d);
+  pthread_mutex_unlock(&d->lock);
+  return ok;
+}
+
+// Funcao auxiliar que diz se uma faixa pode ser atendida por uma thread trabalhadora. O backend stdio
+// depende da posicao do stream e o O_DIRECT com buffer desalinhado usa o buffer alinhado compartilhado,
+// entao nesses casos a operacao e feita na hora por quem submeteu;
+int __bl_aio_concurrent(bl_device *d, char *buffer) {
+  if (d->backend == BL_STDIO) return 0;
+  if (d->backend == BL_DIRECT && ((size_t) buffer % SECTORSIZE) != 0) return 0;
+  return 1;
+}
+
+// Funcao auxiliar que executa uma faixa de setores direto na imagem;
+int __bl_aio_execute(bl_device *d, aio_request *req) {
+  char *buffers[BL_MAX_IOV];
+  for (int feito = 0; feito < req->count; ) {
+    int n = req->count - feito;
+    if (n > BL_MAX_IOV) n = BL_MAX_IOV;
+    for (int i = 0; i < n; i++) {
+      buffers[i] = req->buffer + (size_t) (feito + i) * SECTORSIZE;
+    }
+    int ok = req->write ? __bl_dev_writev(d, req->sector + feito, n, buffers) : __bl_dev_readv(d, req->sector + feito, n, buffers);
+    if (!ok) return 0;
+    feito += n;
+  }
+  return 1;
+}
+
+// Laco das threads trabalhadoras de um dispositivo: retiram pedidos da fila, executam e avisam quem espera.
+// A tabela aio pode ser realocada enquanto a trabalhadora executa, entao o pedido e copiado antes;
+void *__bl_aio_worker(void *arg) {
+  bl_device *d = arg;
+  pthread_mutex_lock(&d->aio_lock);
+  while (1) {
+    while (d->aio_head == -1 && !d->aio_stop) {
+      pthread_cond_wait(&d->aio_work, &d->aio_lock);
+    }
+    if (d->aio_head == -1 && d->aio_stop) break;
+    int tag = d->aio_head;
+    d->aio_head = d->aio[tag].next;
+    if (d->aio_head == -1) d->aio_tail = -1;
+    d->aio[tag].state = AIO_RUNNING;
+    aio_request req = d->aio[tag];
+    pthread_mutex_unlock(&d->aio_lock);
+
+    int result = __bl_aio_execute(d, &req);
+
+    pthread_mutex_lock(&d->aio_lock);
+    d->aio[tag].result = result;
+    d->aio[tag].state = AIO_DONE;
+    pthread_cond_broadcast(&d->aio_done);
+  }
+  pthread_mutex_unlock(&d->aio_lock);
+  return NULL;
+}
+
+// Funcao auxiliar que encerra as threads trabalhadoras, depois de atenderem a fila;
+void __bl_aio_shutdown(bl_device *d) {
+  if (d->aio_depth == 0) return;
+  pthread_mutex_lock(&d->aio_lock);
+  d->aio_stop = 1;
+  pthread_cond_broadcast(&d->aio_work);
+  pthread_mutex_unlock(&d->aio_lock);
+  for (int i = 0; i < d->aio_depth; i++) {
+    pthread_join(d->aio_workers[i], NULL);
+  }
+  free(d->aio_workers);
+  d->aio_workers = NULL;
+  d->aio_depth = 0;
+}
+
+// Funcao auxiliar que (re)inicia as trabalhadoras de um dispositivo, chamada com aio_start;
+int __bl_aio_start(bl_device *d, int depth) {
+  __bl_aio_shutdown(d);
+
+  d->aio_workers = malloc(depth * sizeof(pthread_t));
+  if (d->aio_workers == NULL) {
+    perror("Alocando motor de E/S assíncrona");
+    return 0;
+  }
+  d->aio_stop = 0;
+  for (int i = 0; i < depth; i++) {
+    if (pthread_create(&d->aio_workers[i], NULL, __bl_aio_worker, d) != 0) {
+      perror("Criando thread de E/S");
+      return 0;
+    }
+    d->aio_depth = i + 1;
+  }
+  return 1;
+}
+
+int bl_aio_init(int depth) {
+  if (depth < 1) {
+    printf("Profundidade da fila de E/S inválida\n");
+    return 0;
+  }
+  bl_device *d = __bl_current();
+  pthread_mutex_lock(&d->aio_start);
+  int ok = __bl_aio_start(d, depth);
+  pthread_mutex_unlock(&d->aio_start);
+  return ok;
+}
+
+// Funcao auxiliar que inicia as trabalhadoras no primeiro uso do motor assincrono;
+int __bl_aio_ensure(bl_device *d) {
+  pthread_mutex_lock(&d->aio_start);
+  int ok = d->aio_depth > 0 || __bl_aio_start(d, BL_AIO_DEPTH);
+  pthread_mutex_unlock(&d->aio_start);
+  return ok;
+}
+
+int bl_aio_depth() {
+  bl_device *d = __bl_current();
+  __bl_aio_ensure(d);
+  return d->aio_depth;
+}
+
+// Funcao auxiliar que ocupa um slot de pedido livre, dobrando a tabela quando todos estao em uso.
+// Deve ser chamada com aio_lock;
+int __bl_aio_slot(bl_device *d) {
+  for (int i = 0; i < d->aio_slots; i++) {
+    if (d->aio[i].state == AIO_FREE) return i;
+  }
+  int novos = d->aio_slots == 0 ? BL_AIO_DEPTH : d->aio_slots * 2;
+  aio_request *tabela = realloc(d->aio, novos * sizeof(aio_request));
+  if (tabela == NULL) return -1;
+  memset(tabela + d->aio_slots, 0, (novos - d->aio_slots) * sizeof(aio_request));
+  d->aio = tabela;
+  int livre = d->aio_slots;
+  d->aio_slots = novos;
+  return livre;
+}
+
+// Funcao auxiliar que coloca um pedido na fila das trabalhadoras, sem passar pela cache;
+int __bl_aio_enqueue(bl_device *d, int write, int sector, int count, char *buffer) {
+  if (!__bl_aio_ensure(d)) return -1;
+  pthread_mutex_lock(&d->aio_lock);
+  int tag = __bl_aio_slot(d);
+  if (tag != -1) {
+    d->aio[tag].write = write;
+    d->aio[tag].sector = sector;
+    d->aio[tag].count = count;
+    d->aio[tag].buffer = buffer;
+    d->aio[tag].state = AIO_QUEUED;
+    d->aio[tag].next = -1;
+    if (d->aio_tail == -1) {
+      d->aio_head = tag;
+    } else {
+      d->aio[d->aio_tail].next = tag;
+    }
+    d->aio_tail = tag;
+    pthread_cond_signal(&d->aio_work);
+  }
+  pthread_mutex_unlock(&d->aio_lock);
+  return tag;
+}
+
+// Funcao auxiliar comum as submissoes de leitura e escrita. Retorna o identificador do pedido ou -1;
+int __bl_submit(int write, int sector, int count, char *buffer) {
+  bl_device *d = __bl_current();
+
+  // Escritas atualizam as copias na cache antes de sair, como no bl_writev. Leituras de faixas que tem
+  // algum setor na cache, ou backends sem E/S concorrente, sao feitas na hora pelo caminho sincrono;
+  int imediato = !__bl_aio_concurrent(d, buffer);
+  if (d->cache_capacity > 0) {
+    pthread_mutex_lock(&d->lock);
+    for (int i = 0; i < count; i++) {
+      int slot = __bl_cache_lookup(d, sector + i);
+      if (slot == -1) continue;
+      if (write) {
+        if (!__bl_cache_ready(d, slot, 0)) continue;
+        memcpy(d->cache[slot].data, buffer + (size_t) i * SECTORSIZE, SECTORSIZE);
+        d->cache[slot].dirty = 0;
+      } else {
+        imediato = 1;
+      }
+    }
+    pthread_mutex_unlock(&d->lock);
+  }
+  if (!imediato) return __bl_aio_enqueue(d, write, sector, count, buffer);
+
+  aio_request req = { AIO_RUNNING, write, sector, count, buffer, 0, -1 };
+  int result = write ? __bl_aio_execute(d, &req) : bl_read_range(sector, count, buffer);
+  pthread_mutex_lock(&d->aio_lock);
+  int tag = __bl_aio_slot(d);
+  if (tag != -1) {
+    d->aio[tag] = req;
+    d->aio[tag].result = result;
+    d->aio[tag].state = AIO_DONE;
+  }
+  pthread_mutex_unlock(&d->aio_lock);
+  return tag;
+}
+
+int bl_submit_read(int sector, int count, char *buffer) {
+  return __bl_submit(0, sector, count, buffer);
+}
+
+int bl_submit_write(int sector, int count, char *buffer) {
+  return __bl_submit(1, sector, count, buffer);
+}
+
+// Uma etiqueta invalida, como o -1 de um pedido que nao foi aceito, conta como pronta: o bl_wait dela
+// devolve a falha;
+int bl_poll(int tag) {
+  bl_device *d = __bl_current();
+  if (tag < 0) return 1;
+  pthread_mutex_lock(&d->aio_lock);
+  int pronto = tag >= d->aio_slots || d->aio[tag].state == AIO_DONE;
+  pthread_mutex_unlock(&d->aio_lock);
+  return pronto;
+}
+
+// Funcao auxiliar que espera o pedido terminar, devolve seu resultado e libera o slot. Uma etiqueta
+// invalida devolve falha;
+int __bl_wait(bl_device *d, int tag) {
+  if (tag < 0) return 0;
+  pthread_mutex_lock(&d->aio_lock);
+  if (tag >= d->aio_slots) {
+    pthread_mutex_unlock(&d->aio_lock);
+    return 0;
+  }
+  while (d->aio[tag].state != AIO_DONE) {
+    pthread_cond_wait(&d->aio_done, &d->aio_lock);
+  }
+  int result = d->aio[tag].result;
+  d->aio[tag].state = AIO_FREE;
+  pthread_mutex_unlock(&d->aio_lock);
+  return result;
+}
+
+int bl_wait(int tag) {
+  return __bl_wait(__bl_current(), tag);
+}
+
+int bl_prefetch(int sector, int count) {
+  bl_device *d = __bl_current();
+
+  // No mmap basta avisar o kernel; sem cache ou com backend sem E/S concorrente nao ha onde antecipar;
+  if (d->backend == BL_MMAP) {
+    madvise(d->mapping + (size_t) sector * SECTORSIZE, (size_t) count * SECTORSIZE, MADV_WILLNEED);
+    return 1;
+  }
+  if (d->cache_capacity == 0 || !__bl_aio_concurrent(d, d->cache_data)) return 0;
+
+  // Cada setor ausente ganha um slot na cache e um pedido de leitura assincrona para dentro dele.
+  // Nao antecipamos mais que metade da cache para nao expulsar o que acabou de ser antecipado;
+  if (count > d->cache_capacity / 2) count = d->cache_capacity / 2;
+  pthread_mutex_lock(&d->lock);
+  int ok = 1;
+  for (int i = 0; i < count && ok; i++) {
+    if (__bl_cache_lookup(d, sector + i) != -1) continue;
+    int slot = __bl_cache_victim(d, sector + i);
+    if (slot == -1) {
+      ok = 0;
+      break;
+    }
+    d->cache[slot].tag = __bl_aio_enqueue(d, 0, sector + i, 1, d->cache[slot].data);
+    if (d->cache[slot].tag == -1) {
+      __bl_cache_unhash(d, slot);
+      ok = 0;
+      break;
+    }
+    d->cache[slot].prefetched = 1;
+    d->cache[slot].ref = 0;
+    d->cache_stats.prefetched++;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return ok;
+}
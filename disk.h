@@ -22,7 +22,80 @@
 
 #define SECTORSIZE 4096
 
+// Backends de acesso a imagem, escolhidos com bl_set_backend antes do bl_init;
+#define BL_STDIO 0
+#define BL_MMAP 1
+#define BL_PREAD 2
+#define BL_DIRECT 3
+
+// Capacidade padrao, em setores, da cache de setores criada pelo bl_init;
+#define BL_CACHE_DEFAULT 256
+
+// Profundidade padrao da fila de E/S assincrona;
+#define BL_AIO_DEPTH 8
+
+// Contadores da cache de setores;
+typedef struct {
+  long hits;
+  long misses;
+  long evictions;
+  long writebacks;
+  long prefetched;
+  long prefetch_used;
+  long prefetch_wasted;
+} bl_cache_stats;
+
+// Histograma com baldes logaritmicos: o balde i conta os valores entre 2^i e 2^(i+1) - 1, o primeiro tambem
+// conta o zero e o ultimo tudo que passa dele. Latencias sao registradas em nanossegundos;
+#define BL_HIST_BUCKETS 32
+
+typedef struct {
+  long count;
+  long sum;
+  long buckets[BL_HIST_BUCKETS];
+} bl_histogram;
+
+// Contadores das operacoes feitas na imagem: chamadas de leitura e escrita, cada uma de um ou mais setores,
+// setores transferidos e barreiras de durabilidade, com os histogramas das suas latencias;
+typedef struct {
+  long reads;
+  long writes;
+  long sectors_read;
+  long sectors_written;
+  long syncs;
+  bl_histogram read_latency;
+  bl_histogram write_latency;
+  bl_histogram sync_latency;
+} bl_io_stats;
+
+// Dispositivo: uma imagem aberta com sua cache e seu motor assincrono. Cada thread opera sobre o
+// dispositivo escolhido com bl_use, ou sobre o aberto pelo bl_init se nao escolheu nenhum;
+typedef struct bl_device bl_device;
+
+int bl_set_backend(int kind);
 int bl_init(char *file, int size);
+bl_device *bl_open(char *file, int size);
+int bl_close(bl_device *dev);
+void bl_use(bl_device *dev);
+bl_device *bl_current();
 int bl_size();
 int bl_write(int sector, char* buffer);
 int bl_read(int sector, char* buffer);
+int bl_read_range(int sector, int count, char *buffer);
+int bl_write_range(int sector, int count, char *buffer);
+int bl_readv(int sector, int count, char **buffers);
+int bl_writev(int sector, int count, char **buffers);
+int bl_sync();
+int bl_aio_init(int depth);
+int bl_aio_depth();
+int bl_submit_read(int sector, int count, char *buffer);
+int bl_submit_write(int sector, int count, char *buffer);
+int bl_poll(int tag);
+int bl_wait(int tag);
+int bl_prefetch(int sector, int count);
+int bl_cache_init(int capacity);
+void bl_cache_get_stats(bl_cache_stats *stats);
+void bl_io_get_stats(bl_io_stats *stats);
+void bl_io_reset_stats();
+void bl_histogram_add(bl_histogram *h, long value);
+long bl_histogram_percentile(bl_histogram *h, double p);
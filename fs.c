@@ -25,205 +25,2216 @@
  // Leonardo Valerio Morales  771030
  // Vitor Kenzo F. Pellegatti 771066
  
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "disk.h"
 #include "fs.h"
 
-#define CLUSTERSIZE 4096
-#define FATCLUSTERS 65536
 #define DIRENTRIES 128
-
-unsigned short fat[FATCLUSTERS];
-
-// Criamos 128 file iterators, cada um representa um arquivo do dir;
+#define NAMESIZE 24
+#define FATENTRIES ((int) (SECTORSIZE / sizeof(unsigned int)))
+#define FAT_CACHE 64
+#define WRITE_BATCH 256
+#define AIO_INFLIGHT 64
+#define RA_MIN 4
+#define RA_MAX 64
+#define BUFFER_SLAB 16
+#define DELAY_BYTES (1024 * 1024)
+#define DEFRAG_STEP 1024
+#define JOURNAL_SECTORS 64
+#define JOURNAL_MAGIC 0x4c4e524a
+#define JOURNAL_FAT 0
+#define JOURNAL_DIR 1
+#define FS_MAGIC 0x53465352
+#define FS_VERSION 4
+
+// Valores especiais das entradas da fat; qualquer outro valor aponta para o proximo cluster da cadeia;
+#define FAT_FREE 1
+#define FAT_EOF 2
+#define FAT_RESERVED 3
+#define FAT_DIR_END 4
+#define FAT_JOURNAL 5
+
+// Cada descritor aberto pelo fs_open e um file iterator, que aponta para a entrada do dir do seu arquivo;
+// Varios iteradores podem apontar para o mesmo arquivo, cada um com seu proprio cursor.
 // Cada file iterator possui um buffer que servira para escrita e leitura,
 // Um buffer pointer que possui o indice do buffer que representa o cursor, sendo para leitura ou escrita,
 // Um block pointer que aponta para o bloco atual que estamos lendo ou escrevendo, o modo, que pode ser leitura ou escrita
 // e finalmente um gindex que representa o indice em bytes do arquivo no geral, usado para contar quantos bytes já foram lidos;
+// Na leitura, buffer_valid indica se o buffer ainda contem o bloco apontado por block pointer;
+// Os campos ra_ guardam o estado da leitura antecipada: o gindex esperado se o acesso continuar sequencial,
+// a janela atual em clusters e o ultimo cluster ja antecipado junto com seu indice no arquivo;
+// O buffer vem do pool de buffers e so fica com o iterador enquanto ele esta aberto. Um iterador de escrita
+// ou de acrescimo recebe um buffer proprio de buffer_clusters clusters, para a alocacao atrasada;
+// No acrescimo o buffer comeca com o cluster parcial do fim do arquivo, cujos buffer_base bytes ja contam no
+// tamanho. No modo de leitura e escrita o buffer guarda o cluster do cursor, e dirty indica que ele foi
+// alterado e ainda nao voltou ao disco;
+// shared indica que a cadeia ainda e compartilhada com um clone e precisa ser copiada antes de mudar, e
+// private_end e o ultimo cluster da parte ja copiada, de onde a procura pelo primeiro compartilhado continua
+// (-1 enquanto nada foi copiado);
+// O lock serializa as operacoes sobre o descritor, de forma que descritores diferentes andam em paralelo;
 typedef struct {
-  char buffer[CLUSTERSIZE];
+  pthread_mutex_t lock;
+  char *buffer;
+  int buffer_clusters;
+  int buffer_base;
+  char dirty;
+  char shared;
+  int private_end;
   char open;
+  int entry;
+  char buffer_valid;
   int buffer_pointer;
   int block_pointer;
   int mode;
   int gindex;
+  int ra_next;
+  int ra_window;
+  int ra_block;
+  int ra_index;
 } file_iterator;
 
-file_iterator fit[DIRENTRIES];
-
+// Entrada do diretorio. Um nome de NAMESIZE caracteres ocupa o campo inteiro, sem o '\0', e um nome vazio
+// marca a entrada como livre;
 typedef struct {
-  char used;
-  char name[25];
-  unsigned short first_block;
+  char name[NAMESIZE];
+  unsigned int first_block;
   int size;
 } dir_entry;
 
-dir_entry dir[DIRENTRIES];
+// Superbloco gravado no setor 0 pelo fs_format com a geometria da imagem: quantos clusters a fat cobre, onde
+// ela comeca e quantos setores ocupa, o primeiro cluster do diretorio, o diario e o tamanho do cluster
+// escolhido na formatacao. A fat tem uma entrada de 32 bits por cluster, entao o seu tamanho acompanha o
+// tamanho da imagem, seguida da tabela de referencias dos clusters compartilhados por clones; fat_sectors
+// conta as duas. Superblocos gravados antes do tamanho de cluster existir tem cluster_size 0, que vale
+// um setor.
+// Depois da geometria vem as estatisticas do volume: clusters livres, arquivos e descontinuidades nas
+// cadeias da fat. Elas so valem se clean esta ligado, o que o fs_sync e a desmontagem fazem; a primeira
+// escrita de metadados depois disso desliga clean no disco, e uma montagem que o encontra desligado reconta
+// as estatisticas pela fat;
+typedef struct {
+  int magic;
+  int version;
+  int clusters;
+  int fat_start;
+  int fat_sectors;
+  int dir_start;
+  int journal_start;
+  int journal_clusters;
+  int cluster_size;
+  int free_clusters;
+  int files;
+  int fragments;
+  int clean;
+} fs_super;
+
+// Pagina da fat em memoria: um setor da fat, o instante do seu ultimo uso e se foi alterada;
+typedef struct {
+  int page;
+  char dirty;
+  unsigned long long used;
+  unsigned int *entries;
+} fat_page;
+
+// Indice de extents de um arquivo: a cadeia da fat resumida em trechos contiguos, cada um com o indice no
+// arquivo do seu primeiro cluster. Ele e montado no primeiro acesso aleatorio e compartilhado pelos leitores.
+// Como um arquivo aberto para leitura nao muda, o indice so e descartado quando o arquivo e removido;
+typedef struct {
+  int index;
+  int block;
+  int count;
+} extent;
+
+typedef struct {
+  extent *runs;
+  int count;
+} file_extents;
+
+// Diario de metadados: JOURNAL_SECTORS setores nos clusters logo apos o primeiro cluster do diretorio,
+// marcados na fat com FAT_JOURNAL. O primeiro setor guarda o cabecalho com a sequencia da proxima transacao a
+// ser reaplicada; nos seguintes as transacoes sao escritas em sequencia a partir do segundo. Uma transacao e um journal_tx seguido
+// de count registros, cada um com o novo valor de uma entrada da fat ou de uma entrada do dir;
+typedef struct {
+  int magic;
+  int seq;
+} journal_header;
+
+typedef struct {
+  int magic;
+  int seq;
+  int count;
+  int sectors;
+  unsigned int checksum;
+} journal_tx;
+
+typedef struct {
+  int kind;
+  int index;
+  unsigned int value;
+  dir_entry entry;
+} journal_record;
+
+// Placa do pool de buffers: count buffers do tamanho do cluster em data, no maximo BUFFER_SLAB e no maximo
+// DELAY_BYTES juntos, e a pilha com os indices dos que estao livres;
+typedef struct {
+  char *data;
+  int count;
+  int free_count;
+  int free[BUFFER_SLAB];
+} buffer_slab;
+
+// Uma montagem guarda todo o estado de um sistema de arquivos sobre um dispositivo do disco, de forma que
+// varias imagens podem estar montadas ao mesmo tempo. Cada thread trabalha sobre a montagem escolhida com
+// fs_use, ou sobre a criada pelo fs_init.
+// O meta_lock e um lock de leitores e escritor sobre os metadados (fat, dir, indices, tabela de iteradores):
+// alocacao, criacao, remocao, abertura e commit o tomam para escrita, consultas para leitura. A E/S de dados
+// dos arquivos acontece fora dele, protegida apenas pelo lock do iterador;
+struct fs_mount {
+  bl_device *device;
+  pthread_rwlock_t meta_lock;
+
+  // Geometria lida do superbloco: tamanho do cluster em bytes e em setores, entradas do dir por cluster,
+  // numero de clusters, inicio e tamanho da fat em setores, primeiro cluster do diretorio, do diario e da
+  // area de dados. Sem um superbloco valido fat_sectors e 0. As paginas da fat sao seguidas pelas da tabela
+  // de referencias, e ref_start e o indice na fat da referencia do cluster 0;
+  int cluster_size;
+  int cluster_sectors;
+  int dir_per_cluster;
+  int clusters;
+  int fat_start;
+  int fat_sectors;
+  int ref_start;
+  int dir_start;
+  int journal_start;
+  int journal_clusters;
+  int data_start;
+
+  // Resultado da checagem de formato feita na montagem e no fs_format, e estatisticas do volume mantidas a
+  // cada alteracao da fat e do dir. super_clean diz se o superbloco no disco esta marcado como limpo;
+  int formatted;
+  int free_clusters;
+  int files;
+  int fragments;
+  int super_clean;
+
+  // Contadores de desempenho, atualizados atomicamente por quem fizer a operacao medida;
+  fs_counters counters;
+
+  // Cache de paginas da fat: as paginas sao lidas sob demanda e as mais frias sao descartadas quando ha mais
+  // de FAT_CACHE em memoria, de forma que montar e manter uma imagem grande custa pouca memoria. Paginas
+  // sujas ficam presas ate o commit que as escreve. fat_slot diz onde esta cada pagina da fat em fat_pages
+  // (-1 se nao esta carregada) e fat_free quantos clusters livres ela tem (-1 enquanto nunca foi lida).
+  // O fat_lock protege a cache, ja que leitores sob o meta_lock tambem carregam paginas;
+  pthread_mutex_t fat_lock;
+  fat_page *fat_pages;
+  int fat_page_count;
+  int fat_page_cap;
+  int *fat_slot;
+  int *fat_free;
+  unsigned long long fat_tick;
+
+  // Setores do diretorio modificados em memoria e ainda nao escritos no disco;
+  char *dir_dirty;
+
+  // Cursor de dica que aponta para onde a ultima alocacao parou;
+  int free_hint;
+
+  // Politica de commit dos metadados, intervalo em ms para FS_COMMIT_INTERVAL e o instante do ultimo commit;
+  int commit_policy;
+  int commit_interval;
+  struct timespec last_commit;
+
+  // Tabela de iteradores: o descritor e o indice em fit. A tabela cresce conforme a demanda e os descritores
+  // fechados ficam numa pilha para serem reusados. Os iteradores nao mudam de endereco quando a tabela cresce;
+  file_iterator **fit;
+  int fit_count;
+  int *free_fits;
+  int free_fits_count;
+
+  // Pool de buffers dos iteradores: buffers do tamanho do cluster alocados em placas, que voltam para a lista
+  // de livres da sua placa no fs_close. Uma placa cujos buffers voltaram todos e liberada, a nao ser a primeira,
+  // que fica de reserva; assim a memoria acompanha o numero de descritores abertos;
+  buffer_slab **slabs;
+  int slab_count;
+
+  // O diretorio ocupa uma cadeia de clusters que comeca no cluster dir_start, com DIRENTRIES entradas por
+  // setor e dir_per_cluster por cluster. Na fat cada cluster do diretorio aponta para o proximo, e o ultimo recebe FAT_DIR_END.
+  // Em memoria guardamos todas as entradas em dir e a lista dos clusters da cadeia em dir_clusters;
+  dir_entry *dir;
+  int dir_entries;
+  int *dir_clusters;
+
+  // Indice de nomes construido na montagem: uma tabela hash encadeada (name_buckets/name_next) para achar
+  // um arquivo pelo nome em O(1), e uma pilha com as entradas livres do diretorio para a criacao;
+  int *name_buckets;
+  int name_nbuckets;
+  int *name_next;
+  int *free_entries;
+  int free_entries_count;
+
+  // Quantos iteradores estao abertos para cada entrada do dir, e se um deles e de escrita;
+  int *open_count;
+  char *open_writer;
+
+  // Indices de extents por entrada do dir;
+  file_extents *extents;
+
+  // Estado do desfragmentador incremental: a entrada do dir da vez e, enquanto a cadeia dela e movida, o
+  // inicio da faixa de destino (-1 sem movimento em curso), o tamanho da cadeia e quantos clusters ja foram;
+  int defrag_entry;
+  int defrag_target;
+  int defrag_clusters;
+  int defrag_done;
+
+  // Estado do diario: se a imagem tem diario, a sequencia da proxima transacao e o proximo setor livre.
+  // As entradas da fat e do dir alteradas desde o ultimo commit ficam nas listas log_fat e log_dir. As
+  // marcas dir_logged evitam repeticao no dir; as repeticoes da fat sao retiradas no commit;
+  int journal;
+  int journal_seq;
+  int journal_pos;
+  int *log_fat;
+  int log_fat_count;
+  int log_fat_cap;
+  char *dir_logged;
+  int *log_dir;
+  int log_dir_count;
+  int log_dir_cap;
+};
+
+// Montagem de cada thread, escolhida com fs_use; sem escolha vale a do fs_init;
+__thread fs_mount *current_mount;
+fs_mount *default_mount;
+
+// Funcao auxiliar que devolve a montagem da thread atual, direcionando as chamadas do disco para o seu dispositivo;
+fs_mount *__fs_current() {
+  fs_mount *m = current_mount != NULL ? current_mount : default_mount;
+  bl_use(m->device);
+  return m;
+}
+
+// Nomes das chamadas instrumentadas, na ordem das constantes FS_OP_*;
+char *op_names[FS_OPS] = {"format", "sync", "free", "statfs", "list", "list_next", "create", "remove", "open",
+                          "close", "write", "read", "seek", "pread", "clone", "fallocate", "frag", "defrag"};
+
+// Funcao auxiliar que devolve o relogio monotonico em nanossegundos, usado nos contadores de desempenho;
+long __fs_clock() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+// Funcao auxiliar que registra a latencia de uma chamada da API iniciada em inicio;
+void __fs_op_done(fs_mount *m, int op, long inicio) {
+  bl_histogram_add(&m->counters.ops[op], __fs_clock() - inicio);
+}
+
+// Funcao auxiliar que calcula a geometria de uma imagem com o numero de clusters e o tamanho de cluster
+// dados: o superbloco no setor 0, a fat a partir do setor 1 seguida da tabela de referencias, com uma pagina
+// para cada pagina da fat, o primeiro cluster do diretorio no primeiro cluster inteiro apos elas e o diario
+// em seguida, se a imagem comporta;
+void __fs_geometry(fs_mount *m, int clusters, int cluster_size) {
+  m->cluster_size = cluster_size;
+  m->cluster_sectors = cluster_size / SECTORSIZE;
+  m->dir_per_cluster = DIRENTRIES * m->cluster_sectors;
+  m->clusters = clusters;
+  m->fat_start = 1;
+  m->ref_start = (clusters + FATENTRIES - 1) / FATENTRIES * FATENTRIES;
+  m->fat_sectors = 2 * (m->ref_start / FATENTRIES);
+  m->dir_start = (m->fat_start + m->fat_sectors + m->cluster_sectors - 1) / m->cluster_sectors;
+  // Os clusters que podem ser apontados na fat ficam acima dos valores especiais, que nao sao ponteiros;
+  if (m->dir_start <= FAT_JOURNAL) m->dir_start = FAT_JOURNAL + 1;
+  m->journal_start = m->dir_start + 1;
+  m->journal_clusters = (JOURNAL_SECTORS + m->cluster_sectors - 1) / m->cluster_sectors;
+  if (clusters <= m->journal_start + m->journal_clusters) m->journal_clusters = 0;
+  m->data_start = m->dir_start + 1;
+}
+
+// Funcao auxiliar que diz se um tamanho de cluster pode ser usado: um multiplo do setor entre um setor e
+// FS_CLUSTER_MAX;
+int __fs_valid_cluster(int cluster_size) {
+  return cluster_size >= SECTORSIZE && cluster_size <= FS_CLUSTER_MAX && cluster_size % SECTORSIZE == 0;
+}
 
-int __fs_check_format() {
-  // Checagens de Formatação;
-  size_t i;
-  for (i = 0; i < 32; i++) {
-    // Itera pelos primeiros 32 setores da fat checando se estao com o valor corredo;
-    if (fat[i] != 3) return 0;
+// Funcao auxiliar que preenche o superbloco com a geometria e as estatisticas da montagem;
+void __fs_fill_super(fs_mount *m, fs_super *h, int clean) {
+  memset(h, 0, sizeof(fs_super));
+  h->magic = FS_MAGIC;
+  h->version = FS_VERSION;
+  h->clusters = m->clusters;
+  h->fat_start = m->fat_start;
+  h->fat_sectors = m->fat_sectors;
+  h->dir_start = m->dir_start;
+  h->journal_start = m->journal_start;
+  h->journal_clusters = m->journal_clusters;
+  h->cluster_size = m->cluster_size;
+  h->free_clusters = m->free_clusters;
+  h->files = m->files;
+  h->fragments = m->fragments;
+  h->clean = clean;
+}
+
+// Funcao auxiliar que grava o superbloco, marcando se as estatisticas nele correspondem ao disco;
+void __fs_write_super(fs_mount *m, int clean) {
+  char setor[SECTORSIZE];
+  memset(setor, 0, SECTORSIZE);
+  __fs_fill_super(m, (fs_super *) setor, clean);
+  bl_write(0, setor);
+  bl_sync();
+  m->super_clean = clean;
+}
+
+// Funcao auxiliar chamada antes de escrever metadados no disco: se o superbloco estava limpo ele deixa de
+// estar, ja que as estatisticas gravadas nele vao ficar para tras;
+void __fs_super_dirty(fs_mount *m) {
+  if (m->super_clean) __fs_write_super(m, 0);
+}
+
+// Funcao auxiliar que le o superbloco do setor 0 e adota a sua geometria e, se ele esta limpo, as suas
+// estatisticas. Um superbloco de outra versao ou que nao corresponde a imagem deixa a montagem sem formato;
+int __fs_read_super(fs_mount *m) {
+  char setor[SECTORSIZE];
+  fs_super esperado;
+  fs_super *h = (fs_super *) setor;
+  m->fat_sectors = 0;
+  if (bl_size() < 1) return 0;
+  bl_read(0, setor);
+  if (h->magic != FS_MAGIC || h->version != FS_VERSION) return 0;
+  if (h->cluster_size == 0) h->cluster_size = SECTORSIZE;
+  if (!__fs_valid_cluster(h->cluster_size) || h->clusters < 1) return 0;
+  if (h->clusters > bl_size() / (h->cluster_size / SECTORSIZE)) return 0;
+  __fs_geometry(m, h->clusters, h->cluster_size);
+  m->free_clusters = h->free_clusters;
+  m->files = h->files;
+  m->fragments = h->fragments;
+  m->super_clean = h->clean == 1;
+  __fs_fill_super(m, &esperado, h->clean);
+  if (memcmp(&esperado, h, sizeof(fs_super)) != 0) {
+    m->fat_sectors = 0;
+    return 0;
   }
-  // Faz o mesmo para o setor 33, que tem que possuir o valor 4 para o unico diretorio do arquivo;
-  if (fat[i] != 4) return 0;
+  return 1;
+}
 
+// Funcao auxiliar que descarta todas as paginas da fat em memoria e prepara os indices por pagina para a
+// geometria atual;
+int __fs_fat_reset(fs_mount *m) {
+  for (int i = 0; i < m->fat_page_count; i++) {
+    free(m->fat_pages[i].entries);
+  }
+  m->fat_page_count = 0;
+  free(m->fat_slot);
+  free(m->fat_free);
+  m->fat_slot = NULL;
+  m->fat_free = NULL;
+  m->free_hint = m->data_start;
+  if (m->fat_sectors == 0) return 1;
+
+  m->fat_slot = malloc(m->fat_sectors * sizeof(int));
+  m->fat_free = malloc(m->fat_sectors * sizeof(int));
+  if (m->fat_slot == NULL || m->fat_free == NULL) {
+    printf("Sem memória para a fat!⚠⚠⚠⚠⚠\n");
+    m->fat_sectors = 0;
+    return 0;
+  }
+  for (int i = 0; i < m->fat_sectors; i++) {
+    m->fat_slot[i] = -1;
+    m->fat_free[i] = -1;
+  }
   return 1;
 }
 
-// Funcao auxiliar do fs que encontra um arquivo com nome dado no vetor dir;
-int __fs_find_file(char *file_name) {
-  int alvo = -1;
-  for (size_t i = 0; i < DIRENTRIES; i++) {
-    // Caso não encontremos o arquivo para leitura retornamos erro;
-    if(strcmp(dir[i].name, file_name) == 0 && dir[i].used == 1) {
-      alvo = i;     
-      break;
+// Funcao auxiliar que escolhe onde carregar uma pagina da fat: um lugar novo enquanto a cache tem menos de
+// FAT_CACHE paginas, senao o da pagina limpa usada ha mais tempo. Se todas estao sujas a cache cresce;
+int __fs_fat_victim(fs_mount *m) {
+  if (m->fat_page_count >= FAT_CACHE) {
+    int vitima = -1;
+    for (int i = 0; i < m->fat_page_count; i++) {
+      if (m->fat_pages[i].dirty) continue;
+      if (vitima == -1 || m->fat_pages[i].used < m->fat_pages[vitima].used) vitima = i;
+    }
+    if (vitima != -1) {
+      m->fat_slot[m->fat_pages[vitima].page] = -1;
+      return vitima;
+    }
+  }
+  if (m->fat_page_count == m->fat_page_cap) {
+    int novo = m->fat_page_cap == 0 ? FAT_CACHE : m->fat_page_cap * 2;
+    fat_page *p = realloc(m->fat_pages, novo * sizeof(fat_page));
+    if (p == NULL) {
+      printf("Sem memória para a fat!⚠⚠⚠⚠⚠\n");
+      return -1;
+    }
+    m->fat_pages = p;
+    m->fat_page_cap = novo;
+  }
+  m->fat_pages[m->fat_page_count].entries = malloc(SECTORSIZE);
+  if (m->fat_pages[m->fat_page_count].entries == NULL) {
+    printf("Sem memória para a fat!⚠⚠⚠⚠⚠\n");
+    return -1;
+  }
+  return m->fat_page_count++;
+}
+
+// Funcao auxiliar que devolve as entradas de uma pagina da fat, lendo-a do disco se nao esta em memoria.
+// Na primeira leitura de uma pagina contamos os seus clusters livres. Deve ser chamada com o fat_lock, e o
+// ponteiro devolvido so vale enquanto ele estiver tomado;
+unsigned int *__fs_fat_page(fs_mount *m, int page) {
+  int s = m->fat_slot[page];
+  if (s == -1) {
+    s = __fs_fat_victim(m);
+    if (s == -1) return NULL;
+    fat_page *p = &m->fat_pages[s];
+    bl_read(m->fat_start + page, (char *) p->entries);
+    p->page = page;
+    p->dirty = 0;
+    m->fat_slot[page] = s;
+    if (m->fat_free[page] == -1) {
+      int livres = 0;
+      for (int i = 0; i < FATENTRIES; i++) {
+        int c = page * FATENTRIES + i;
+        if (c >= m->data_start && c < m->clusters && p->entries[i] == FAT_FREE) livres++;
+      }
+      m->fat_free[page] = livres;
+    }
+  }
+  m->fat_pages[s].used = ++m->fat_tick;
+  return m->fat_pages[s].entries;
+}
+
+// Funcao auxiliar que, depois que um commit limpou as paginas sujas, devolve a cache da fat ao seu tamanho
+// normal descartando as paginas mais frias. Deve ser chamada com o fat_lock;
+void __fs_fat_trim(fs_mount *m) {
+  while (m->fat_page_count > FAT_CACHE) {
+    int vitima = -1;
+    for (int i = 0; i < m->fat_page_count; i++) {
+      if (m->fat_pages[i].dirty) continue;
+      if (vitima == -1 || m->fat_pages[i].used < m->fat_pages[vitima].used) vitima = i;
+    }
+    if (vitima == -1) return;
+    m->fat_slot[m->fat_pages[vitima].page] = -1;
+    free(m->fat_pages[vitima].entries);
+    m->fat_pages[vitima] = m->fat_pages[--m->fat_page_count];
+    if (vitima < m->fat_page_count) m->fat_slot[m->fat_pages[vitima].page] = vitima;
+  }
+}
+
+// Funcao auxiliar que le uma entrada qualquer das paginas da fat, seja da fat ou da tabela de referencias;
+unsigned int __fs_get_entry(fs_mount *m, int index) {
+  if (index < 0 || index >= m->ref_start + m->clusters || m->fat_sectors == 0) return FAT_RESERVED;
+  pthread_mutex_lock(&m->fat_lock);
+  unsigned int *entries = __fs_fat_page(m, index / FATENTRIES);
+  unsigned int valor = entries != NULL ? entries[index % FATENTRIES] : FAT_RESERVED;
+  pthread_mutex_unlock(&m->fat_lock);
+  return valor;
+}
+
+// Funcao auxiliar que le uma entrada da fat. Clusters fora da imagem sao tratados como reservados;
+unsigned int __fs_get_fat(fs_mount *m, int cluster) {
+  if (cluster < 0 || cluster >= m->clusters) return FAT_RESERVED;
+  return __fs_get_entry(m, cluster);
+}
+
+// Funcao auxiliar que le quantas referencias a mais, alem da primeira, um cluster tem. Um cluster so e
+// compartilhado depois de um clone, entao na maioria dos clusters isso vale 0;
+unsigned int __fs_get_ref(fs_mount *m, int cluster) {
+  if (cluster < 0 || cluster >= m->clusters) return 0;
+  return __fs_get_entry(m, m->ref_start + cluster);
+}
+
+// Funcao auxiliar que diz se o valor de uma entrada da fat e um ponteiro para um cluster que nao e o vizinho,
+// ou seja, uma descontinuidade na cadeia;
+int __fs_is_break(fs_mount *m, int cluster, unsigned int value) {
+  return value >= m->data_start && value < m->clusters && value != cluster + 1;
+}
+
+// Funcao auxiliar que altera uma entrada das paginas da fat, que fica suja. Nas entradas da fat mantemos as
+// contagens de clusters livres da pagina e do volume e de descontinuidades;
+void __fs_put_entry(fs_mount *m, int index, unsigned int value) {
+  if (index < 0 || index >= m->ref_start + m->clusters || m->fat_sectors == 0) return;
+  pthread_mutex_lock(&m->fat_lock);
+  int page = index / FATENTRIES;
+  unsigned int *entries = __fs_fat_page(m, page);
+  if (entries != NULL) {
+    unsigned int antigo = entries[index % FATENTRIES];
+    entries[index % FATENTRIES] = value;
+    m->fat_pages[m->fat_slot[page]].dirty = 1;
+    if (index >= m->data_start && index < m->clusters) {
+      m->fat_free[page] += (value == FAT_FREE) - (antigo == FAT_FREE);
+      m->free_clusters += (value == FAT_FREE) - (antigo == FAT_FREE);
+    }
+    if (index < m->clusters) {
+      m->fragments += __fs_is_break(m, index, value) - __fs_is_break(m, index, antigo);
+    }
+  }
+  pthread_mutex_unlock(&m->fat_lock);
+}
+
+// Funcao auxiliar que altera uma entrada da fat;
+void __fs_put_fat(fs_mount *m, int cluster, unsigned int value) {
+  if (cluster < 0 || cluster >= m->clusters) return;
+  __fs_put_entry(m, cluster, value);
+}
+
+// Funcao auxiliar que reconta pela fat inteira os clusters livres e as descontinuidades, para quando o
+// superbloco nao esta limpo. Percorre todas as paginas da fat pela cache;
+void __fs_count_fat(fs_mount *m) {
+  m->free_clusters = 0;
+  m->fragments = 0;
+  pthread_mutex_lock(&m->fat_lock);
+  for (int page = 0; page < m->ref_start / FATENTRIES; page++) {
+    unsigned int *entries = __fs_fat_page(m, page);
+    if (entries == NULL) continue;
+    m->free_clusters += m->fat_free[page];
+    for (int i = 0; i < FATENTRIES && page * FATENTRIES + i < m->clusters; i++) {
+      m->fragments += __fs_is_break(m, page * FATENTRIES + i, entries[i]);
+    }
+  }
+  pthread_mutex_unlock(&m->fat_lock);
+}
+
+// Funcao auxiliar de checagem de formato, feita uma vez na montagem: a geometria veio de um superbloco
+// valido, o cluster do superbloco esta reservado e o primeiro cluster do diretorio tem o valor de fim ou
+// aponta para o proximo cluster do diretorio;
+int __fs_validate(fs_mount *m) {
+  if (m->fat_sectors == 0) return 0;
+  if (__fs_get_fat(m, 0) != FAT_RESERVED) return 0;
+  unsigned int dir = __fs_get_fat(m, m->dir_start);
+  if (dir != FAT_DIR_END && (dir < m->data_start || dir >= m->clusters)) return 0;
+  return 1;
+}
+
+int __fs_check_format(fs_mount *m) {
+  // Checagens de Formatação: o resultado da validacao feita na montagem ou no fs_format;
+  return m->formatted;
+}
+
+// Funcao auxiliar que calcula o hash (FNV-1a) de um nome de arquivo, de no maximo NAMESIZE caracteres como
+// os das entradas do dir;
+unsigned int __fs_hash(char *name) {
+  unsigned int h = 2166136261u;
+  for (int i = 0; i < NAMESIZE && name[i]; i++) {
+    h ^= (unsigned char) name[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Funcao auxiliar que diz se uma entrada do dir esta em uso;
+int __fs_used(fs_mount *m, int entry) {
+  return m->dir[entry].name[0] != '\0';
+}
+
+// Funcao auxiliar que copia o nome de uma entrada do dir para nome, com espaco para NAMESIZE + 1 bytes;
+void __fs_entry_name(fs_mount *m, int entry, char *nome) {
+  strncpy(nome, m->dir[entry].name, NAMESIZE);
+  nome[NAMESIZE] = '\0';
+}
+
+// Funcao auxiliar que coloca uma entrada usada no indice de nomes;
+void __fs_index_insert(fs_mount *m, int entry) {
+  int bucket = __fs_hash(m->dir[entry].name) & (m->name_nbuckets - 1);
+  m->name_next[entry] = m->name_buckets[bucket];
+  m->name_buckets[bucket] = entry;
+}
+
+// Funcao auxiliar que retira uma entrada do indice de nomes;
+void __fs_index_remove(fs_mount *m, int entry) {
+  int *link = &m->name_buckets[__fs_hash(m->dir[entry].name) & (m->name_nbuckets - 1)];
+  while (*link != entry) {
+    link = &m->name_next[*link];
+  }
+  *link = m->name_next[entry];
+}
+
+// Funcao auxiliar que reconstroi o indice de nomes e a pilha de entradas livres a partir do dir.
+// A tabela hash tem ao menos uma posicao por entrada do diretorio;
+int __fs_build_dir_index(fs_mount *m) {
+  m->name_nbuckets = 1;
+  while (m->name_nbuckets < m->dir_entries) m->name_nbuckets <<= 1;
+  free(m->name_buckets);
+  m->name_buckets = malloc(m->name_nbuckets * sizeof(int));
+  int *next = realloc(m->name_next, m->dir_entries * sizeof(int));
+  int *livres = realloc(m->free_entries, m->dir_entries * sizeof(int));
+  if (m->name_buckets == NULL || next == NULL || livres == NULL) {
+    printf("Sem memória para o índice do diretório!⚠⚠⚠⚠⚠\n");
+    return 0;
+  }
+  m->name_next = next;
+  m->free_entries = livres;
+  for (int i = 0; i < m->name_nbuckets; i++) {
+    m->name_buckets[i] = -1;
+  }
+
+  // As entradas livres sao empilhadas de tras para frente para que as primeiras sejam usadas primeiro;
+  m->free_entries_count = 0;
+  for (int i = m->dir_entries - 1; i >= 0; i--) {
+    if (__fs_used(m, i)) {
+      __fs_index_insert(m, i);
+    } else {
+      m->free_entries[m->free_entries_count++] = i;
+    }
+  }
+  return 1;
+}
+
+// Funcao auxiliar que ajusta os vetores que acompanham o diretorio para n clusters;
+int __fs_resize_dir(fs_mount *m, int n) {
+  int total = n * m->dir_per_cluster;
+  dir_entry *d = realloc(m->dir, total * sizeof(dir_entry));
+  if (d != NULL) m->dir = d;
+  int *c = realloc(m->dir_clusters, n * sizeof(int));
+  if (c != NULL) m->dir_clusters = c;
+  char *sujo = realloc(m->dir_dirty, n * m->cluster_sectors);
+  if (sujo != NULL) m->dir_dirty = sujo;
+  int *abertos = realloc(m->open_count, total * sizeof(int));
+  if (abertos != NULL) m->open_count = abertos;
+  char *escritor = realloc(m->open_writer, total);
+  if (escritor != NULL) m->open_writer = escritor;
+  file_extents *e = realloc(m->extents, total * sizeof(file_extents));
+  if (e != NULL) m->extents = e;
+  char *registrado = realloc(m->dir_logged, total);
+  if (registrado != NULL) m->dir_logged = registrado;
+  if (d == NULL || c == NULL || sujo == NULL || abertos == NULL || escritor == NULL || e == NULL || registrado == NULL) {
+    printf("Sem memória para o diretório!⚠⚠⚠⚠⚠\n");
+    return 0;
+  }
+
+  // Entradas novas comecam vazias e sem iteradores abertos;
+  if (total > m->dir_entries) {
+    memset(m->dir + m->dir_entries, 0, (total - m->dir_entries) * sizeof(dir_entry));
+    memset(m->open_count + m->dir_entries, 0, (total - m->dir_entries) * sizeof(int));
+    memset(m->open_writer + m->dir_entries, 0, total - m->dir_entries);
+    memset(m->extents + m->dir_entries, 0, (total - m->dir_entries) * sizeof(file_extents));
+    memset(m->dir_logged + m->dir_entries, 0, total - m->dir_entries);
+    for (int i = m->dir_entries; i < total; i++) {
+      m->dir[i].first_block = -1;
+    }
+  }
+  m->dir_entries = total;
+  return 1;
+}
+
+// Funcao auxiliar que pega um buffer do pool. Preferimos a placa mais ocupada, para que as outras esvaziem e
+// possam ser liberadas, e alocamos uma nova placa quando nao ha buffers livres;
+char *__fs_buffer_get(fs_mount *m) {
+  buffer_slab *placa = NULL;
+  for (int i = 0; i < m->slab_count; i++) {
+    buffer_slab *p = m->slabs[i];
+    if (p->free_count > 0 && (placa == NULL || p->free_count < placa->free_count)) placa = p;
+  }
+  if (placa == NULL) {
+    buffer_slab **placas = realloc(m->slabs, (m->slab_count + 1) * sizeof(buffer_slab *));
+    if (placas == NULL) return NULL;
+    m->slabs = placas;
+    placa = malloc(sizeof(buffer_slab));
+    if (placa == NULL) return NULL;
+    placa->count = DELAY_BYTES / m->cluster_size;
+    if (placa->count > BUFFER_SLAB) placa->count = BUFFER_SLAB;
+    if (placa->count < 1) placa->count = 1;
+    placa->data = malloc((size_t) placa->count * m->cluster_size);
+    if (placa->data == NULL) {
+      free(placa);
+      return NULL;
+    }
+    placa->free_count = 0;
+    for (int i = placa->count - 1; i >= 0; i--) {
+      placa->free[placa->free_count++] = i;
     }
+    m->slabs[m->slab_count++] = placa;
+  }
+  return placa->data + (size_t) placa->free[--placa->free_count] * m->cluster_size;
+}
+
+// Funcao auxiliar que devolve um buffer a sua placa no pool, liberando a placa se ela ficou vazia e nao e a
+// de reserva;
+void __fs_buffer_put(fs_mount *m, char *buffer) {
+  for (int i = 0; i < m->slab_count; i++) {
+    buffer_slab *p = m->slabs[i];
+    if (buffer < p->data || buffer >= p->data + (size_t) p->count * m->cluster_size) continue;
+    p->free[p->free_count++] = (buffer - p->data) / m->cluster_size;
+    if (p->free_count == p->count && i > 0) {
+      free(p->data);
+      free(p);
+      m->slabs[i] = m->slabs[--m->slab_count];
+    }
+    return;
+  }
+}
+
+// Funcao auxiliar que libera todas as placas do pool de buffers;
+void __fs_free_buffers(fs_mount *m) {
+  for (int i = 0; i < m->slab_count; i++) {
+    free(m->slabs[i]->data);
+    free(m->slabs[i]);
+  }
+  m->slab_count = 0;
+}
+
+// Funcao auxiliar que faz o desfragmentador desistir do arquivo de uma entrada, se ele estava sendo movido,
+// quando a cadeia pode mudar por outro caminho. O que ja foi movido continua valido;
+void __fs_defrag_forget(fs_mount *m, int entry) {
+  if (m->defrag_entry == entry) m->defrag_target = -1;
+}
+
+// Funcao auxiliar que abre um novo iterador para a entrada do dir dada, com buffer do pool.
+// Se nao ha descritores livres a tabela dobra de tamanho. Retorna o descritor ou -1;
+// Chamada com o meta_lock para escrita;
+int __fs_open_fit(fs_mount *m, int entry, int mode) {
+  if (m->free_fits_count == 0) {
+    int novos = m->fit_count == 0 ? DIRENTRIES : m->fit_count * 2;
+    file_iterator **tabela = realloc(m->fit, novos * sizeof(file_iterator *));
+    if (tabela != NULL) m->fit = tabela;
+    int *livres = realloc(m->free_fits, novos * sizeof(int));
+    if (livres != NULL) m->free_fits = livres;
+    if (tabela == NULL || livres == NULL) return -1;
+    for (int i = m->fit_count; i < novos; i++) {
+      m->fit[i] = calloc(1, sizeof(file_iterator));
+      if (m->fit[i] == NULL) {
+        m->fit_count = i;
+        return -1;
+      }
+      pthread_mutex_init(&m->fit[i]->lock, NULL);
+    }
+    for (int i = novos - 1; i >= m->fit_count; i--) {
+      m->free_fits[m->free_fits_count++] = i;
+    }
+    m->fit_count = novos;
+  }
+
+  // A escrita acumula ate DELAY_BYTES no buffer antes de alocar clusters; sem memoria para isso o iterador
+  // fica com um buffer do pool, de um cluster;
+  int clusters = 1;
+  char *buffer = NULL;
+  if (mode == FS_W || mode == FS_A) {
+    clusters = DELAY_BYTES / m->cluster_size;
+    if (clusters > WRITE_BATCH) clusters = WRITE_BATCH;
+    if (clusters > 1) buffer = malloc((size_t) clusters * m->cluster_size);
+    if (buffer == NULL) clusters = 1;
+  }
+  if (buffer == NULL) buffer = __fs_buffer_get(m);
+  if (buffer == NULL) return -1;
+  int file = m->free_fits[--m->free_fits_count];
+  file_iterator *f = m->fit[file];
+
+  f->buffer = buffer;
+  f->buffer_clusters = clusters;
+  f->entry = entry;
+  f->block_pointer = m->dir[entry].first_block;
+  f->open = 1;
+  f->buffer_pointer = 0;
+  f->mode = mode;
+  f->gindex = 0;
+  f->buffer_valid = 0;
+  f->ra_next = 0;
+  f->ra_window = 0;
+  f->ra_block = -1;
+  f->ra_index = -1;
+  f->buffer_base = 0;
+  f->dirty = 0;
+  f->shared = 0;
+  f->private_end = -1;
+
+  m->open_count[entry]++;
+  if (mode != FS_R) {
+    m->open_writer[entry] = 1;
+    __fs_defrag_forget(m, entry);
+  }
+  return file;
+}
+
+// Funcao auxiliar que fecha um iterador, devolvendo seu buffer ao pool e seu descritor a pilha de livres;
+// Chamada com o meta_lock para escrita;
+void __fs_close_fit(fs_mount *m, int file) {
+  file_iterator *f = m->fit[file];
+  int entry = f->entry;
+  m->open_count[entry]--;
+  if (f->mode != FS_R) m->open_writer[entry] = 0;
+
+  if (f->buffer_clusters > 1) {
+    free(f->buffer);
+  } else {
+    __fs_buffer_put(m, f->buffer);
+  }
+  f->buffer = NULL;
+  f->block_pointer = 0;
+  f->open = 0;
+  f->buffer_pointer = 0;
+  f->mode = -1;
+  f->gindex = 0;
+  f->buffer_valid = 0;
+  m->free_fits[m->free_fits_count++] = file;
+}
+
+// Funcao auxiliar que encontra o iterador aberto do descritor file no modo dado (-1 aceita qualquer modo)
+// e o devolve com seu lock tomado, ou NULL depois de avisar o erro. FS_W tambem aceita o acrescimo, e tanto
+// FS_R quanto FS_W aceitam a leitura e escrita. O iterador e aberto e fechado com o
+// meta_lock para escrita, entao o estado de aberto e conferido com ele para leitura. A ordem dos locks e
+// sempre a do iterador antes do meta_lock;
+file_iterator *__fs_lock_fit(fs_mount *m, int file, int mode) {
+  pthread_rwlock_rdlock(&m->meta_lock);
+  if (!__fs_check_format(m)) {
+    pthread_rwlock_unlock(&m->meta_lock);
+    printf("Sistema de arquivo não formatado!⚠⚠⚠⚠⚠\n");
+    return NULL;
+  }
+  file_iterator *f = file >= 0 && file < m->fit_count ? m->fit[file] : NULL;
+  pthread_rwlock_unlock(&m->meta_lock);
+
+  // Depois de tomar o lock conferimos, o descritor pode ter sido fechado enquanto esperavamos;
+  if (f != NULL) {
+    pthread_mutex_lock(&f->lock);
+    pthread_rwlock_rdlock(&m->meta_lock);
+    int aberto = f->open == 1 && (mode == -1 || f->mode == mode || (f->mode == FS_A && mode == FS_W) ||
+                                  f->mode == FS_RW);
+    pthread_rwlock_unlock(&m->meta_lock);
+    if (aberto) return f;
+    pthread_mutex_unlock(&f->lock);
+  }
+  if (mode == FS_R) {
+    printf("Arquivo não está aberto ou não está em modo de leitura!⚠⚠⚠⚠⚠");
+  } else if (mode == FS_W) {
+    printf("Arquivo não está aberto ou não está em modo de escrita!⚠⚠⚠⚠⚠");
+  } else {
+    printf("Arquivo não está aberto!⚠⚠⚠⚠⚠");
+  }
+  return NULL;
+}
+
+// Funcao auxiliar que descarta o indice de extents de uma entrada do dir;
+void __fs_drop_extents(fs_mount *m, int entry) {
+  free(m->extents[entry].runs);
+  m->extents[entry].runs = NULL;
+  m->extents[entry].count = 0;
+}
+
+// Funcao auxiliar que monta o indice de extents de uma entrada, percorrendo sua cadeia uma unica vez.
+// O bloco vazio do fim da cadeia tambem entra no indice. Retorna 0 se faltar memoria;
+int __fs_build_extents(fs_mount *m, int entry) {
+  if (m->extents[entry].runs != NULL) return 1;
+
+  int cap = 8;
+  int count = 0;
+  extent *runs = malloc(cap * sizeof(extent));
+  if (runs == NULL) return 0;
+
+  int indice = 0;
+  int bloco = m->dir[entry].first_block;
+  while (bloco != FAT_EOF) {
+    if (count > 0 && runs[count - 1].block + runs[count - 1].count == bloco) {
+      runs[count - 1].count++;
+    } else {
+      if (count == cap) {
+        extent *r = realloc(runs, cap * 2 * sizeof(extent));
+        if (r == NULL) {
+          free(runs);
+          return 0;
+        }
+        runs = r;
+        cap *= 2;
+      }
+      runs[count].index = indice;
+      runs[count].block = bloco;
+      runs[count].count = 1;
+      count++;
+    }
+    indice++;
+    bloco = __fs_get_fat(m, bloco);
+  }
+
+  m->extents[entry].runs = runs;
+  m->extents[entry].count = count;
+  return 1;
+}
+
+// Funcao auxiliar que encontra, por busca binaria no indice de extents, o cluster de indice dado do arquivo;
+int __fs_extent_block(fs_mount *m, int entry, int indice) {
+  extent *runs = m->extents[entry].runs;
+  int lo = 0;
+  int hi = m->extents[entry].count - 1;
+  while (lo < hi) {
+    int meio = (lo + hi + 1) / 2;
+    if (runs[meio].index <= indice) {
+      lo = meio;
+    } else {
+      hi = meio - 1;
+    }
+  }
+  return runs[lo].block + (indice - runs[lo].index);
+}
+
+// Funcao auxiliar que acrescenta ao indice de extents de uma entrada os clusters ligados depois do ultimo
+// indexado, quando a cadeia so cresceu pelo fim. Sem memoria o indice e descartado e remontado quando preciso;
+void __fs_extend_extents(fs_mount *m, int entry) {
+  if (m->extents[entry].runs == NULL) return;
+  int count = m->extents[entry].count;
+  extent *runs = m->extents[entry].runs;
+  int indice = runs[count - 1].index + runs[count - 1].count;
+  unsigned int bloco = __fs_get_fat(m, runs[count - 1].block + runs[count - 1].count - 1);
+  while (bloco != FAT_EOF) {
+    if (runs[count - 1].block + runs[count - 1].count == bloco) {
+      runs[count - 1].count++;
+    } else {
+      extent *r = realloc(runs, (count + 1) * sizeof(extent));
+      if (r == NULL) {
+        __fs_drop_extents(m, entry);
+        return;
+      }
+      runs = r;
+      m->extents[entry].runs = runs;
+      runs[count].index = indice;
+      runs[count].block = bloco;
+      runs[count].count = 1;
+      m->extents[entry].count = ++count;
+    }
+    indice++;
+    bloco = __fs_get_fat(m, bloco);
+  }
+}
+
+// Funcao auxiliar do fs que encontra um arquivo com nome dado no vetor dir, pelo indice de nomes;
+int __fs_find_file(fs_mount *m, char *file_name) {
+  if (strlen(file_name) > NAMESIZE) return -1;
+  int alvo = m->name_buckets[__fs_hash(file_name) & (m->name_nbuckets - 1)];
+  while (alvo != -1 && strncmp(m->dir[alvo].name, file_name, NAMESIZE) != 0) {
+    alvo = m->name_next[alvo];
   }
   return alvo;
 }
 
 // Funcao Auxiliar interna do fs que retorna o proximo setor livre da fat, e consequentemente arquivo;
-int __fs_next_free_fat() {
-  for (size_t i = 33; i < bl_size(); i++) {
-    if (fat[i] == 1) return i;
+// Se near for um cluster valido preferimos o cluster logo apos ele, para manter a cadeia do arquivo contigua.
+// Caso contrario percorremos as paginas da fat a partir do cursor de dica, pulando as que sabemos estar
+// cheias pela contagem de livres, de forma que so as paginas com espaco sao lidas;
+int __fs_next_free_fat(fs_mount *m, int near) {
+  if (near >= m->data_start && near + 1 < m->clusters && __fs_get_fat(m, near + 1) == FAT_FREE) {
+    bl_histogram_add(&m->counters.alloc_scan, 1);
+    return near + 1;
+  }
+
+  if (m->free_clusters <= 0) return -1;
+  // Entradas examinadas ate achar um cluster livre, para o histograma do alocador;
+  long examinadas = 0;
+  int paginas = m->ref_start / FATENTRIES;
+  int start = m->free_hint / FATENTRIES;
+  for (int n = 0; n <= paginas; n++) {
+    int page = (start + n) % paginas;
+    if (m->fat_free[page] == 0) continue;
+    // Na primeira pagina ignoramos os clusters antes do cursor, eles sao vistos na volta completa;
+    int inicio = page * FATENTRIES;
+    if (n == 0 && m->free_hint > inicio) inicio = m->free_hint;
+    if (inicio < m->data_start) inicio = m->data_start;
+    int fim = (page + 1) * FATENTRIES;
+    if (fim > m->clusters) fim = m->clusters;
+
+    pthread_mutex_lock(&m->fat_lock);
+    unsigned int *entries = __fs_fat_page(m, page);
+    for (int c = inicio; entries != NULL && c < fim; c++) {
+      if (entries[c - page * FATENTRIES] == FAT_FREE) {
+        pthread_mutex_unlock(&m->fat_lock);
+        bl_histogram_add(&m->counters.alloc_scan, examinadas + c - inicio + 1);
+        m->free_hint = c;
+        return c;
+      }
+    }
+    pthread_mutex_unlock(&m->fat_lock);
+    if (fim > inicio) examinadas += fim - inicio;
   }
+  bl_histogram_add(&m->counters.alloc_scan, examinadas);
   return -1;
 }
 
-// Funcao Auxiliar interna do fs que escreve a fat e o unico dir no arquivo;
-void __fs_write_fat_dir_disk() {
-  for (size_t i = 0; i < 32; i++) {
-    bl_write(i, ((char*) &fat) + i*CLUSTERSIZE);
+// Funcao auxiliar que acrescenta um valor a uma lista que cresce conforme a demanda;
+void __fs_push(int **lista, int *count, int *cap, int valor) {
+  if (*count == *cap) {
+    int novo = *cap == 0 ? 64 : *cap * 2;
+    int *l = realloc(*lista, novo * sizeof(int));
+    if (l == NULL) {
+      printf("Sem memória para o diário!⚠⚠⚠⚠⚠\n");
+      return;
+    }
+    *lista = l;
+    *cap = novo;
   }
-  bl_write(32,(char*) &dir);
+  (*lista)[(*count)++] = valor;
 }
 
+// Funcao auxiliar que altera uma entrada da fat, deixando a sua pagina suja. Com diario a entrada entra na
+// proxima transacao;
+void __fs_set_fat(fs_mount *m, int cluster, unsigned int value) {
+  if (m->journal) __fs_push(&m->log_fat, &m->log_fat_count, &m->log_fat_cap, cluster);
+  __fs_put_fat(m, cluster, value);
+}
+
+// Funcao auxiliar que altera as referencias a mais de um cluster, registrando a entrada da tabela no
+// diario como as da fat;
+void __fs_set_ref(fs_mount *m, int cluster, unsigned int refs) {
+  if (cluster < 0 || cluster >= m->clusters) return;
+  if (m->journal) __fs_push(&m->log_fat, &m->log_fat_count, &m->log_fat_cap, m->ref_start + cluster);
+  __fs_put_entry(m, m->ref_start + cluster, refs);
+}
+
+// Funcao auxiliar que marca como sujo o cluster do diretorio que contem a entrada dada;
+// Com diario a entrada entra na proxima transacao;
+void __fs_touch_dir(fs_mount *m, int entry) {
+  m->dir_dirty[entry / DIRENTRIES] = 1;
+  if (m->journal && !m->dir_logged[entry]) {
+    m->dir_logged[entry] = 1;
+    __fs_push(&m->log_dir, &m->log_dir_count, &m->log_dir_cap, entry);
+  }
+}
+
+// Setor de metadados sujo a ser escrito, com o buffer em memoria correspondente;
+typedef struct {
+  int sector;
+  char *buffer;
+} meta_sector;
+
+// Funcao auxiliar de ordenacao dos setores de metadados pelo numero do setor;
+int __fs_cmp_meta(const void *a, const void *b) {
+  return ((meta_sector *) a)->sector - ((meta_sector *) b)->sector;
+}
+
+// Funcao Auxiliar interna do fs que escreve no arquivo os setores sujos da fat e do dir;
+// Os setores de metadados sujos que sao vizinhos no disco (o dir comeca logo apos a fat) sao agrupados
+// e cada grupo vai para o disco em uma unica escrita vetorizada. Depois as paginas da fat ficam limpas e a
+// cache da fat pode voltar ao seu tamanho normal;
+void __fs_write_fat_dir_disk(fs_mount *m) {
+  long inicio = __fs_clock();
+  int setores = m->dir_entries / DIRENTRIES;
+  pthread_mutex_lock(&m->fat_lock);
+  meta_sector *sujos = malloc((m->fat_page_count + setores) * sizeof(meta_sector));
+  char **buffers = malloc((m->fat_page_count + setores) * sizeof(char *));
+  if (sujos == NULL || buffers == NULL) {
+    pthread_mutex_unlock(&m->fat_lock);
+    printf("Sem memória para escrever os metadados!⚠⚠⚠⚠⚠\n");
+    free(sujos);
+    free(buffers);
+    return;
+  }
+  int n = 0;
+  for (int i = 0; i < m->fat_page_count; i++) {
+    if (m->fat_pages[i].dirty) {
+      sujos[n].sector = m->fat_start + m->fat_pages[i].page;
+      sujos[n++].buffer = (char *) m->fat_pages[i].entries;
+    }
+  }
+  for (int i = 0; i < setores; i++) {
+    if (m->dir_dirty[i]) {
+      sujos[n].sector = m->dir_clusters[i / m->cluster_sectors] * m->cluster_sectors + i % m->cluster_sectors;
+      sujos[n++].buffer = (char*) (m->dir + i * DIRENTRIES);
+    }
+  }
+  if (n > 0) __fs_super_dirty(m);
+  qsort(sujos, n, sizeof(meta_sector), __fs_cmp_meta);
+  for (int i = 0; i < n; ) {
+    int j = i;
+    while (j < n && sujos[j].sector == sujos[i].sector + (j - i)) {
+      buffers[j - i] = sujos[j].buffer;
+      j++;
+    }
+    bl_writev(sujos[i].sector, j - i, buffers);
+    i = j;
+  }
+  free(sujos);
+  free(buffers);
+  for (int i = 0; i < m->fat_page_count; i++) {
+    m->fat_pages[i].dirty = 0;
+  }
+  __fs_fat_trim(m);
+  pthread_mutex_unlock(&m->fat_lock);
+  memset(m->dir_dirty, 0, setores);
+  // Os dados e metadados que estavam adiados na cache de setores tambem vao para a imagem;
+  bl_sync();
+  clock_gettime(CLOCK_MONOTONIC, &m->last_commit);
+  if (n > 0) {
+    __atomic_fetch_add(&m->counters.flushed_sectors, n, __ATOMIC_RELAXED);
+    bl_histogram_add(&m->counters.flushes, __fs_clock() - inicio);
+  }
+}
+
+// Funcao auxiliar que esquece as entradas alteradas, ja escritas no diario ou no lugar;
+void __fs_journal_clear(fs_mount *m) {
+  for (int i = 0; i < m->log_dir_count; i++) {
+    m->dir_logged[m->log_dir[i]] = 0;
+  }
+  m->log_fat_count = 0;
+  m->log_dir_count = 0;
+}
+
+// Funcao auxiliar que calcula a soma de verificacao (FNV-1a) dos registros de uma transacao;
+unsigned int __fs_checksum(char *dados, int n) {
+  unsigned int h = 2166136261u;
+  for (int i = 0; i < n; i++) {
+    h ^= (unsigned char) dados[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Funcao auxiliar que escreve o cabecalho do diario com a sequencia da proxima transacao;
+void __fs_journal_header(fs_mount *m) {
+  char setor[SECTORSIZE];
+  memset(setor, 0, SECTORSIZE);
+  journal_header *h = (journal_header *) setor;
+  h->magic = JOURNAL_MAGIC;
+  h->seq = m->journal_seq;
+  bl_write_range(m->journal_start * m->cluster_sectors, 1, setor);
+}
+
+// Funcao auxiliar de checkpoint: a fat e o dir sujos vao para o seu lugar no disco e, depois dessa
+// escrita estar no disco, o cabecalho do diario passa a apontar para depois da ultima transacao, que
+// deixam de precisar ser reaplicadas. Uma queda no meio apenas faz a montagem reaplicar o diario de novo;
+void __fs_checkpoint(fs_mount *m) {
+  __fs_write_fat_dir_disk(m);
+  __fs_journal_clear(m);
+  if (!m->journal || m->journal_pos == 1) return;
+  __fs_journal_header(m);
+  bl_sync();
+  m->journal_pos = 1;
+}
+
+// Funcao auxiliar de ordenacao de inteiros;
+int __fs_cmp_int(const void *a, const void *b) {
+  return *(int *) a - *(int *) b;
+}
+
+// Funcao auxiliar de commit com diario. Todas as entradas da fat e do dir alteradas desde o ultimo commit,
+// por quantas operacoes forem, viram uma unica transacao escrita em sequencia no diario e uma unica
+// sincronizacao, que tambem leva os dados adiados na cache. O lugar da fat e do dir so e atualizado no
+// checkpoint, feito quando metade do diario esta em uso. Uma transacao maior que meio diario e
+// escrita direto no lugar pelo checkpoint;
+void __fs_journal_commit(fs_mount *m) {
+  // Uma entrada da fat alterada varias vezes vai uma vez so, com o seu valor atual;
+  qsort(m->log_fat, m->log_fat_count, sizeof(int), __fs_cmp_int);
+  int unicos = 0;
+  for (int i = 0; i < m->log_fat_count; i++) {
+    if (unicos == 0 || m->log_fat[unicos - 1] != m->log_fat[i]) m->log_fat[unicos++] = m->log_fat[i];
+  }
+  m->log_fat_count = unicos;
+
+  int count = m->log_fat_count + m->log_dir_count;
+  if (count == 0) {
+    bl_sync();
+    clock_gettime(CLOCK_MONOTONIC, &m->last_commit);
+    return;
+  }
+
+  int bytes = sizeof(journal_tx) + count * sizeof(journal_record);
+  int sectors = (bytes + SECTORSIZE - 1) / SECTORSIZE;
+  if (m->journal_pos + sectors > JOURNAL_SECTORS) {
+    __fs_checkpoint(m);
+    return;
+  }
+
+  char *buffer = calloc(sectors, SECTORSIZE);
+  if (buffer == NULL) {
+    __fs_checkpoint(m);
+    return;
+  }
+  long inicio = __fs_clock();
+  __fs_super_dirty(m);
+  journal_record *r = (journal_record *) (buffer + sizeof(journal_tx));
+  for (int i = 0; i < m->log_fat_count; i++, r++) {
+    r->kind = JOURNAL_FAT;
+    r->index = m->log_fat[i];
+    r->value = __fs_get_entry(m, m->log_fat[i]);
+  }
+  for (int i = 0; i < m->log_dir_count; i++, r++) {
+    r->kind = JOURNAL_DIR;
+    r->index = m->log_dir[i];
+    r->entry = m->dir[m->log_dir[i]];
+  }
+  journal_tx *tx = (journal_tx *) buffer;
+  tx->magic = JOURNAL_MAGIC;
+  tx->seq = m->journal_seq;
+  tx->count = count;
+  tx->sectors = sectors;
+  tx->checksum = __fs_checksum(buffer + sizeof(journal_tx), count * sizeof(journal_record));
+
+  bl_write_range(m->journal_start * m->cluster_sectors + m->journal_pos, sectors, buffer);
+  bl_sync();
+  free(buffer);
+  m->journal_pos += sectors;
+  m->journal_seq++;
+  __fs_journal_clear(m);
+  clock_gettime(CLOCK_MONOTONIC, &m->last_commit);
+  bl_histogram_add(&m->counters.commits, __fs_clock() - inicio);
+
+  if (m->journal_pos > JOURNAL_SECTORS / 2) __fs_checkpoint(m);
+}
+
+// Funcao auxiliar que le do diario as transacoes ainda nao aplicadas no lugar, a partir do segundo setor
+// do diario e com a sequencia do cabecalho, parando na primeira que esteja incompleta ou fora de sequencia.
+// Devolve os registros encontrados em *registros, e a quantidade de transacoes;
+int __fs_journal_read(fs_mount *m, journal_record **registros, int *count) {
+  *registros = NULL;
+  *count = 0;
+  char *diario = malloc((size_t) JOURNAL_SECTORS * SECTORSIZE);
+  if (diario == NULL) return 0;
+  bl_read_range(m->journal_start * m->cluster_sectors, JOURNAL_SECTORS, diario);
+
+  journal_header *h = (journal_header *) diario;
+  m->journal_seq = h->seq;
+  int transacoes = 0;
+  int pos = 1;
+  while (pos < JOURNAL_SECTORS) {
+    journal_tx *tx = (journal_tx *) (diario + (size_t) pos * SECTORSIZE);
+    if (tx->magic != JOURNAL_MAGIC || tx->seq != m->journal_seq || tx->sectors < 1 || pos + tx->sectors > JOURNAL_SECTORS) break;
+    if (tx->count < 0 || sizeof(journal_tx) + tx->count * sizeof(journal_record) > (size_t) tx->sectors * SECTORSIZE) break;
+    char *dados = (char *) tx + sizeof(journal_tx);
+    if (__fs_checksum(dados, tx->count * sizeof(journal_record)) != tx->checksum) break;
+
+    journal_record *r = realloc(*registros, (*count + tx->count) * sizeof(journal_record));
+    if (r == NULL) break;
+    *registros = r;
+    memcpy(*registros + *count, dados, tx->count * sizeof(journal_record));
+    *count += tx->count;
+    pos += tx->sectors;
+    m->journal_seq++;
+    transacoes++;
+  }
+  m->journal_pos = pos;
+  free(diario);
+  return transacoes;
+}
+
+// Funcao auxiliar chamada nos pontos de commit do fs. O ponto pode ser o fim de um cluster (FS_COMMIT_CLUSTER)
+// ou uma operacao que encerra o uso de um arquivo (FS_COMMIT_CLOSE). A politica configurada decide se os
+// metadados sujos sao escritos agora ou adiados;
+void __fs_commit(fs_mount *m, int point) {
+  if (m->commit_policy == FS_COMMIT_INTERVAL) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed = (now.tv_sec - m->last_commit.tv_sec) * 1000 + (now.tv_nsec - m->last_commit.tv_nsec) / 1000000;
+    if (elapsed < m->commit_interval) return;
+  } else if (m->commit_policy == FS_COMMIT_CLOSE && point == FS_COMMIT_CLUSTER) {
+    return;
+  }
+  if (m->journal) {
+    __fs_journal_commit(m);
+  } else {
+    __fs_write_fat_dir_disk(m);
+  }
+}
+
+
+// Funcao auxiliar que aloca de uma vez uma cadeia de n clusters, cada um de preferencia vizinho ao anterior,
+// comecando perto de near. Os clusters ficam encadeados entre si e o ultimo marcado como fim de arquivo.
+// Se nao houver espaco para todos, desfazemos o que foi alocado e retornamos 0;
+int __fs_alloc_chain(fs_mount *m, int near, int n, int *chain) {
+  for (int i = 0; i < n; i++) {
+    int livre = __fs_next_free_fat(m, i == 0 ? near : chain[i - 1]);
+    if (livre == -1) {
+      for (int j = 0; j < i; j++) {
+        __fs_set_fat(m, chain[j], FAT_FREE);
+      }
+      return 0;
+    }
+    __fs_set_fat(m, livre, FAT_EOF);
+    if (i > 0) __fs_set_fat(m, chain[i - 1], livre);
+    chain[i] = livre;
+  }
+  return 1;
+}
+
+// Funcao auxiliar que procura n clusters livres contiguos, primeiro a partir do cluster seguinte a near e
+// depois desde o comeco da area de dados. Paginas sem clusters livres sao puladas pela contagem de livres.
+// Retorna o primeiro cluster da faixa, ou -1 se nenhuma faixa livre tem n clusters;
+int __fs_find_run(fs_mount *m, int near, int n) {
+  if (n > m->free_clusters) return -1;
+  int inicio = near >= m->data_start && near + 1 < m->clusters ? near + 1 : m->free_hint;
+  if (inicio < m->data_start) inicio = m->data_start;
+
+  pthread_mutex_lock(&m->fat_lock);
+  for (int volta = 0; volta < 2; volta++) {
+    int c = volta == 0 ? inicio : m->data_start;
+    int ate = volta == 0 ? m->clusters : inicio + n - 1;
+    if (ate > m->clusters) ate = m->clusters;
+    int faixa = 0;
+    while (c < ate) {
+      int page = c / FATENTRIES;
+      unsigned int *entries = m->fat_free[page] == 0 ? NULL : __fs_fat_page(m, page);
+      int fim = (page + 1) * FATENTRIES < ate ? (page + 1) * FATENTRIES : ate;
+      if (entries == NULL) {
+        faixa = 0;
+        c = fim;
+        continue;
+      }
+      for (; c < fim; c++) {
+        faixa = entries[c % FATENTRIES] == FAT_FREE ? faixa + 1 : 0;
+        if (faixa == n) {
+          pthread_mutex_unlock(&m->fat_lock);
+          return c - n + 1;
+        }
+      }
+    }
+  }
+  pthread_mutex_unlock(&m->fat_lock);
+  return -1;
+}
+
+// Funcao auxiliar que devolve em chain os n clusters que seguem block na cadeia, estendendo a cadeia se for
+// preciso. Clusters ja ligados apos block, reservados pelo fs_fallocate, sao usados primeiro; os que faltam
+// sao alocados de uma vez, numa faixa contigua se houver uma livre. Se nao houver espaco a cadeia fica como
+// estava e retornamos 0;
+int __fs_extend_chain(fs_mount *m, int block, int n, int *chain) {
+  int i = 0;
+  int ultimo = block;
+  while (i < n) {
+    unsigned int prox = __fs_get_fat(m, ultimo);
+    if (prox < m->data_start || prox >= m->clusters) break;
+    chain[i++] = prox;
+    ultimo = prox;
+  }
+  if (i == n) return 1;
+
+  int faixa = __fs_find_run(m, ultimo, n - i);
+  if (!__fs_alloc_chain(m, faixa > m->data_start ? faixa - 1 : ultimo, n - i, chain + i)) return 0;
+  __fs_set_fat(m, ultimo, chain[i]);
+  return 1;
+}
+
+// Funcao auxiliar que libera os clusters reservados que sobraram apos block, o ultimo cluster de um arquivo
+// que esta sendo fechado;
+void __fs_trim_chain(fs_mount *m, int block) {
+  unsigned int prox = __fs_get_fat(m, block);
+  if (prox < m->data_start || prox >= m->clusters) return;
+  __fs_set_fat(m, block, FAT_EOF);
+  while (prox >= m->data_start && prox < m->clusters) {
+    unsigned int seguinte = __fs_get_fat(m, prox);
+    __fs_set_fat(m, prox, FAT_FREE);
+    prox = seguinte;
+  }
+}
+
+// Funcao auxiliar que le um cluster inteiro para o buffer. Clusters de um setor passam pela cache de setores.
+// Retorna 0 se o disco falhou;
+int __fs_read_cluster(fs_mount *m, int cluster, char *buffer) {
+  if (m->cluster_sectors == 1) return bl_read(cluster, buffer);
+  return bl_read_range(cluster * m->cluster_sectors, m->cluster_sectors, buffer);
+}
+
+// Funcao auxiliar que escreve um cluster inteiro a partir do buffer. Clusters de um setor passam pela cache
+// de setores. Retorna 0 se o disco falhou;
+int __fs_write_cluster(fs_mount *m, int cluster, char *buffer) {
+  if (m->cluster_sectors == 1) return bl_write(cluster, buffer);
+  return bl_write_range(cluster * m->cluster_sectors, m->cluster_sectors, buffer);
+}
+
+// Funcao auxiliar que submete uma faixa de clusters ao motor assincrono do disco, guardando o pedido em tags.
+// Se ja temos tantos pedidos em voo quanto a fila do disco aceita, esperamos o mais antigo antes. Retorna 0
+// se esse pedido falhou; um pedido que nem pode ser submetido fica com a tag -1, que falha na espera;
+int __fs_submit(fs_mount *m, int write, int block, int n, char *buffer, int *tags, int *pendentes) {
+  int limite = bl_aio_depth();
+  if (limite > AIO_INFLIGHT) limite = AIO_INFLIGHT;
+  int ok = 1;
+  if (*pendentes == limite) {
+    ok = bl_wait(tags[0]);
+    memmove(tags, tags + 1, (*pendentes - 1) * sizeof(int));
+    (*pendentes)--;
+  }
+  int setor = block * m->cluster_sectors;
+  int setores = n * m->cluster_sectors;
+  tags[(*pendentes)++] = write ? bl_submit_write(setor, setores, buffer) : bl_submit_read(setor, setores, buffer);
+  return ok;
+}
+
+// Funcao auxiliar que espera todos os pedidos em voo de uma operacao. Retorna 1 se todos deram certo;
+int __fs_wait_all(int *tags, int *pendentes) {
+  int ok = 1;
+  for (int i = 0; i < *pendentes; i++) {
+    if (!bl_wait(tags[i])) ok = 0;
+  }
+  *pendentes = 0;
+  return ok;
+}
+
+// Funcao auxiliar que deixa so para o arquivo de um iterador a parte da sua cadeia que vai ate o cluster ate
+// (-1 para a cadeia inteira), antes da primeira alteracao dele. Os clusters compartilhados com um clone
+// formam sempre o fim da cadeia, entao basta copiar do primeiro compartilhado ate ate, e o resto continua
+// compartilhado: um cluster proprio pode apontar para um compartilhado. A copia vai em lotes de ate
+// DELAY_BYTES, cada um para uma faixa contigua de clusters livres quando ha uma, com a leitura e a escrita
+// pelo motor assincrono fora do meta_lock. So depois dos dados estarem no disco o lote entra na cadeia, e
+// cada original perde uma referencia, ou e liberado se o clone deixou de usa-lo enquanto copiavamos. Sem
+// espaco a copia para no meio, o que ainda deixa as duas cadeias validas, e retornamos 0.
+// Chamada com o lock do iterador;
+int __fs_unshare(fs_mount *m, file_iterator *f, int ate) {
+  int lote = DELAY_BYTES / m->cluster_size;
+  if (lote > WRITE_BATCH) lote = WRITE_BATCH;
+  if (lote < 1) lote = 1;
+  char *dados = malloc((size_t) lote * m->cluster_size);
+  if (dados == NULL) {
+    printf("Sem memória para copiar o arquivo!⚠⚠⚠⚠⚠\n");
+    return 0;
+  }
+  int entry = f->entry;
+
+  // O primeiro cluster compartilhado vem logo depois da parte ja copiada antes;
+  pthread_rwlock_wrlock(&m->meta_lock);
+  int anterior = f->private_end;
+  unsigned int bloco = anterior == -1 ? m->dir[entry].first_block : __fs_get_fat(m, anterior);
+  while (bloco != FAT_EOF && (int) bloco != ate && __fs_get_ref(m, bloco) == 0) {
+    anterior = bloco;
+    bloco = __fs_get_fat(m, bloco);
+  }
+
+  int ok = 1;
+  int fim = 0;
+  int copiados = 0;
+  while (ok && !fim && bloco != FAT_EOF && __fs_get_ref(m, bloco) > 0) {
+    int origem[WRITE_BATCH];
+    int chain[WRITE_BATCH];
+    int k = 0;
+    while (k < lote && bloco != FAT_EOF && !fim) {
+      origem[k++] = bloco;
+      fim = (int) bloco == ate;
+      bloco = __fs_get_fat(m, bloco);
+    }
+    int faixa = __fs_find_run(m, anterior, k);
+    if (!__fs_alloc_chain(m, faixa > m->data_start ? faixa - 1 : anterior, k, chain)) {
+      printf("ACABOU O ESPAÇO!⚠⚠⚠⚠⚠\n");
+      bloco = origem[0];
+      ok = 0;
+      break;
+    }
+    pthread_rwlock_unlock(&m->meta_lock);
+
+    // Os originais e as copias sao lidos e escritos em trechos contiguos, e as copias vao para o disco antes
+    // de qualquer metadado que aponte para elas;
+    int tags[AIO_INFLIGHT];
+    int pendentes = 0;
+    for (int j = 0, n = 1; j < k; j += n) {
+      for (n = 1; j + n < k && origem[j + n] == origem[j + n - 1] + 1; n++);
+      if (!__fs_submit(m, 0, origem[j], n, dados + (size_t) j * m->cluster_size, tags, &pendentes)) ok = 0;
+    }
+    if (!__fs_wait_all(tags, &pendentes)) ok = 0;
+    for (int j = 0, n = 1; ok && j < k; j += n) {
+      for (n = 1; j + n < k && chain[j + n] == chain[j + n - 1] + 1; n++);
+      if (!__fs_submit(m, 1, chain[j], n, dados + (size_t) j * m->cluster_size, tags, &pendentes)) ok = 0;
+    }
+    if (!__fs_wait_all(tags, &pendentes)) ok = 0;
+    if (ok) ok = bl_sync();
+
+    pthread_rwlock_wrlock(&m->meta_lock);
+    if (!ok) {
+      printf("Erro ao copiar o arquivo no disco!⚠⚠⚠⚠⚠\n");
+      for (int j = 0; j < k; j++) {
+        __fs_set_fat(m, chain[j], FAT_FREE);
+      }
+      bloco = origem[0];
+      break;
+    }
+    __fs_set_fat(m, chain[k - 1], bloco);
+    if (anterior == -1) {
+      m->dir[entry].first_block = chain[0];
+      __fs_touch_dir(m, entry);
+    } else {
+      __fs_set_fat(m, anterior, chain[0]);
+    }
+    for (int j = 0; j < k; j++) {
+      unsigned int refs = __fs_get_ref(m, origem[j]);
+      if (refs > 0) {
+        __fs_set_ref(m, origem[j], refs - 1);
+      } else {
+        __fs_set_fat(m, origem[j], FAT_FREE);
+      }
+      if (f->block_pointer == origem[j]) f->block_pointer = chain[j];
+    }
+    anterior = chain[k - 1];
+    copiados = 1;
+  }
+  free(dados);
+
+  // Os clusters mudaram, entao o indice de extents e a leitura antecipada recomecam. So sabemos que nada mais
+  // e compartilhado quando a parte propria chega ao fim da cadeia;
+  if (copiados) {
+    __fs_drop_extents(m, entry);
+    f->ra_window = 0;
+    f->ra_block = -1;
+    f->ra_index = -1;
+  }
+  f->private_end = anterior;
+  f->shared = bloco != FAT_EOF;
+  __fs_commit(m, FS_COMMIT_CLUSTER);
+  pthread_rwlock_unlock(&m->meta_lock);
+  return ok;
+}
+
+// Funcao auxiliar que copia a parte compartilhada da cadeia de um iterador ate o cluster ate (-1 para a
+// cadeia inteira), se ainda for preciso, antes de altera-la. Como so o fim da cadeia e compartilhado, um
+// cluster ate que nao e ja garante que nada antes dele e. Chamada com o lock do iterador;
+int __fs_own_chain(fs_mount *m, file_iterator *f, int ate) {
+  if (!f->shared) return 1;
+  if (ate != -1 && __fs_get_ref(m, ate) == 0) return 1;
+  return __fs_unshare(m, f, ate);
+}
+
+// Funcao auxiliar que escreve n clusters inteiros de um buffer, o do usuario ou o buffer atrasado do fit.
+// O primeiro vai para o bloco atual do arquivo e os demais para os clusters que o seguem na cadeia, reservados
+// ou alocados de uma so vez; o ultimo deles passa a ser o novo bloco atual, vazio, como acontece no
+// __fs_flush_fit. O tamanho do arquivo so cresce depois dos dados estarem no disco, entao clusters ligados a
+// cadeia antes disso ficam alem do fim do arquivo.
+// Chamada com o lock do iterador; o meta_lock so e tomado para estender a cadeia e depois para o tamanho;
+int __fs_write_direct(fs_mount *m, file_iterator *f, char *buffer, int n) {
+  int chain[WRITE_BATCH];
+  pthread_rwlock_wrlock(&m->meta_lock);
+  int ok = __fs_extend_chain(m, f->block_pointer, n, chain);
+  pthread_rwlock_unlock(&m->meta_lock);
+  if (!ok) return 0;
+
+  // Os blocos de destino sao o atual seguido da cadeia; cada trecho contiguo e uma escrita, e varias
+  // ficam em voo ao mesmo tempo. Esperamos todas antes de tocar nos metadados que apontam para elas;
+  // Se alguma falhou o arquivo fica como estava, com os clusters ligados alem do fim ate o fechamento;
+  int tags[AIO_INFLIGHT];
+  int pendentes = 0;
+  int inicio = 0;
+  for (int i = 1; i <= n; i++) {
+    int anterior = i == 1 ? f->block_pointer : chain[i - 2];
+    if (i == n || chain[i - 1] != anterior + 1) {
+      int primeiro = inicio == 0 ? f->block_pointer : chain[inicio - 1];
+      if (!__fs_submit(m, 1, primeiro, i - inicio, buffer + (size_t) inicio * m->cluster_size, tags, &pendentes)) ok = 0;
+      inicio = i;
+    }
+  }
+  if (!__fs_wait_all(tags, &pendentes)) ok = 0;
+  if (!ok) {
+    printf("Erro de escrita no disco!⚠⚠⚠⚠⚠\n");
+    return 0;
+  }
+
+  pthread_rwlock_wrlock(&m->meta_lock);
+  f->block_pointer = chain[n - 1];
+  m->dir[f->entry].size += n * m->cluster_size - f->buffer_base;
+  f->buffer_base = 0;
+  __fs_touch_dir(m, f->entry);
+
+  // Um unico ponto de commit para todos os clusters escritos;
+  __fs_commit(m, FS_COMMIT_CLUSTER);
+  pthread_rwlock_unlock(&m->meta_lock);
+  return 1;
+}
 
 // Funcao auxiliar que o buffer de um arquivo em seu setor especifico, busca o proximo setor livre,
 // escreve na fat esse setor livre e também atualiza no fit. Além disso aumenta o tamanho do arquivo em dir com base na qnt de bytes
-// escritos pelo flush;
-int  __fs_flush_fit(int file, int qnt) {
-  // Buscamos proximo setor livre, se nao existe retornamos 0 de erro;
-  int livre = __fs_next_free_fat();
-  if (livre == -1) return 0;
-
-  // Escrevemos no arquivo
-  bl_write(fit[file].block_pointer, fit[file].buffer);
+// escritos pelo flush; Chamada com o lock do iterador, o dado vai para o disco antes de tomarmos o meta_lock;
+int  __fs_flush_fit(fs_mount *m, file_iterator *f, int qnt) {
+  // Escrevemos no arquivo; se o disco falhar nada muda e retornamos 0 de erro;
+  if (!__fs_write_cluster(m, f->block_pointer, f->buffer)) {
+    printf("Erro de escrita no disco!⚠⚠⚠⚠⚠\n");
+    return 0;
+  }
 
-  // Escrevemos na fat este proximo setor livre que sera o proximo do arquivo
-  fat[fit[file].block_pointer] = livre;
+  // Buscamos o proximo setor do arquivo: o reservado que segue o atual ou um livre, de preferencia vizinho ao
+  // atual, que passa a ser o fim do arquivo. Se nao existe retornamos 0 de erro;
+  pthread_rwlock_wrlock(&m->meta_lock);
+  int livre;
+  if (!__fs_extend_chain(m, f->block_pointer, 1, &livre)) {
+    pthread_rwlock_unlock(&m->meta_lock);
+    return 0;
+  }
 
   // E no fit este proximo setor
-  fit[file].block_pointer = fat[fit[file].block_pointer];
-
-  // Este proximo setor sera o fim do arquivo
-  fat[fit[file].block_pointer] = 2;
+  f->block_pointer = livre;
 
   // Reiniciamos o ponteiro do buffer do arquivo
-  fit[file].buffer_pointer = 0;
+  f->buffer_pointer = 0;
 
   // Aumentamos o tamanho do arquivo pela quantidade de bytes escritos, na maioria dos casos sera SECTORSIZE mas
-  // é possivel que o fs_close() feche um arquivo com buffer de tamanho menor que SECTORSIZE, por isso a generalização
-  dir[file].size += qnt;
+  // é possivel que o fs_close() feche um arquivo com buffer de tamanho menor que SECTORSIZE, por isso a generalização.
+  // No acrescimo os bytes que ja estavam no cluster parcial do fim nao contam de novo;
+  m->dir[f->entry].size += qnt - f->buffer_base;
+  f->buffer_base = 0;
+  __fs_touch_dir(m, f->entry);
+
+  // Ponto de commit do fim de cluster, a politica decide se a fat e o dir vao para o disco agora;
+  __fs_commit(m, FS_COMMIT_CLUSTER);
+  pthread_rwlock_unlock(&m->meta_lock);
+  return 1;
+}
 
-  // Escrevemos a fat e o dir no disco novamente;
-  __fs_write_fat_dir_disk();
+// Funcao auxiliar que descarrega o buffer atrasado de um arquivo sendo escrito: os clusters cheios vao para o
+// disco de uma vez, com os clusters atribuidos agora numa faixa contigua, e o resto, um cluster parcial, pelo
+// __fs_flush_fit. Se o disco nao tem mais espaco para todos de uma vez escrevemos um cluster por vez, ate
+// onde couber, e o que sobra continua no buffer. Chamada com o lock do iterador;
+int __fs_flush_delayed(fs_mount *m, file_iterator *f) {
+  int cheios = f->buffer_pointer / m->cluster_size;
+  int feitos = cheios;
+  if (cheios > 0 && !__fs_write_direct(m, f, f->buffer, cheios)) {
+    feitos = 0;
+    while (feitos < cheios && __fs_write_direct(m, f, f->buffer + (size_t) feitos * m->cluster_size, 1)) feitos++;
+  }
+  f->buffer_pointer -= feitos * m->cluster_size;
+  memmove(f->buffer, f->buffer + (size_t) feitos * m->cluster_size, f->buffer_pointer);
+  if (feitos < cheios) return 0;
+  return f->buffer_pointer == 0 || __fs_flush_fit(m, f, f->buffer_pointer);
+}
+
+// Funcao auxiliar que devolve ao disco o cluster alterado de um iterador de leitura e escrita. O cursor esta
+// logo apos o ultimo byte escrito no cluster, entao se ele passou do fim o arquivo cresce ate ele. Um arquivo
+// sempre tem um bloco vazio depois do ultimo cluster com dados; se os dados chegaram ao bloco vazio, ligamos
+// um novo depois dele antes de aumentar o tamanho. Chamada com o lock do iterador;
+int __fs_rw_flush(fs_mount *m, file_iterator *f) {
+  if (!f->dirty) return 1;
+  if (!__fs_write_cluster(m, f->block_pointer, f->buffer)) {
+    printf("Erro de escrita no disco!⚠⚠⚠⚠⚠\n");
+    return 0;
+  }
+
+  pthread_rwlock_wrlock(&m->meta_lock);
+  if (f->gindex > m->dir[f->entry].size) {
+    if (__fs_get_fat(m, f->block_pointer) == FAT_EOF) {
+      int livre;
+      if (!__fs_extend_chain(m, f->block_pointer, 1, &livre)) {
+        pthread_rwlock_unlock(&m->meta_lock);
+        return 0;
+      }
+      __fs_extend_extents(m, f->entry);
+    }
+    m->dir[f->entry].size = f->gindex;
+    __fs_touch_dir(m, f->entry);
+  }
+  __fs_commit(m, FS_COMMIT_CLUSTER);
+  pthread_rwlock_unlock(&m->meta_lock);
+  f->dirty = 0;
   return 1;
 }
 
+// Funcao auxiliar que descarrega o que um iterador ainda guarda no buffer, antes de fecha-lo: o buffer
+// atrasado na escrita e no acrescimo, o cluster alterado na leitura e escrita;
+int __fs_flush_pending(fs_mount *m, file_iterator *f) {
+  if (f->mode == FS_RW) return __fs_rw_flush(m, f);
+  if (f->mode == FS_R || f->buffer_pointer == f->buffer_base) return 1;
+  return __fs_flush_delayed(m, f);
+}
+
+// Funcao auxiliar que acerta a cadeia de um arquivo que deixa de ser escrito: os clusters reservados e nao
+// usados voltam a ficar livres e o indice de extents ganha os clusters acrescentados. Se o acrescimo nao
+// escreveu nada, o bloco atual ainda e o cluster parcial do fim, e a reserva so comeca depois do bloco vazio
+// que o segue. Chamada com o lock do iterador e o meta_lock para escrita;
+void __fs_settle_chain(fs_mount *m, file_iterator *f) {
+  if (f->mode == FS_W || f->mode == FS_A) {
+    int ultimo = f->block_pointer;
+    if (f->buffer_base > 0) ultimo = __fs_get_fat(m, ultimo);
+    if (ultimo != FAT_EOF) __fs_trim_chain(m, ultimo);
+  }
+  __fs_extend_extents(m, f->entry);
+}
+
+// Funcao auxiliar da escrita no lugar, chamada com o lock do iterador. O cursor segue a mesma convencao da
+// leitura, entao leituras, escritas e seeks se alternam no mesmo descritor. Cada cluster e lido para o buffer,
+// alterado nele e so volta ao disco quando o cursor sai dele, no seek, na leitura ou no fechamento;
+int __fs_overwrite(fs_mount *m, file_iterator *f, char *buffer, int size) {
+  int escrito = 0;
+  while (escrito < size) {
+    // No fim do cluster o devolvemos ao disco e passamos para o proximo, que sempre existe: no pior caso e o
+    // bloco vazio do fim do arquivo;
+    if (f->buffer_pointer == m->cluster_size) {
+      if (!__fs_rw_flush(m, f)) {
+        printf("Não há mais espaço no disco para dar flush!⚠⚠⚠⚠⚠\n");
+        return escrito > 0 ? escrito : -1;
+      }
+      f->block_pointer = __fs_get_fat(m, f->block_pointer);
+      f->buffer_pointer = 0;
+      f->buffer_valid = 0;
+      continue;
+    }
+
+    // Antes da primeira alteracao de um cluster compartilhado com um clone, a cadeia e copiada ate ele;
+    if (!f->dirty && !__fs_own_chain(m, f, f->block_pointer)) return escrito > 0 ? escrito : -1;
+
+    // Um cluster que sera coberto inteiro nao precisa ser lido antes;
+    int trecho = m->cluster_size - f->buffer_pointer;
+    if (trecho > size - escrito) trecho = size - escrito;
+    if (!f->buffer_valid) {
+      if (trecho < m->cluster_size && !__fs_read_cluster(m, f->block_pointer, f->buffer)) {
+        printf("Erro de leitura no disco!⚠⚠⚠⚠⚠\n");
+        return escrito > 0 ? escrito : -1;
+      }
+      f->buffer_valid = 1;
+    }
+    memcpy(f->buffer + f->buffer_pointer, buffer + escrito, trecho);
+    f->buffer_pointer += trecho;
+    f->gindex += trecho;
+    f->dirty = 1;
+    escrito += trecho;
+  }
+  return escrito;
+}
+
 // Funcao Auxiliar interna do fs que printa a fat guardada em memoria;
-void __fs_print_fat(){
-  char* buffer = (char *) fat;
-  for (size_t i = 0; i < sizeof(fat); i++) {
+void __fs_print_fat(fs_mount *m) {
+  for (int i = 0; i < m->clusters; i++) {
     if (i % 100 == 0) {
       printf("\n");
     }
-    printf("%d ", buffer[i]);
+    printf("%u ", __fs_get_fat(m, i));
   }
 }
 
 // Funcao Auxiliar para printar os fits ativos;
-void __fs_print_fit() {
-  for (size_t i = 0; i < DIRENTRIES; i++) {
-    if (fit[i].open == 1) {
-      printf("FIT ENCONTRADO: \n");
-      printf("Modo: %d, Block Pointer: %d, Buffer Pointer: %d\n", fit[i].mode, fit[i].block_pointer, fit[i].buffer_pointer);
+void __fs_print_fit(fs_mount *m) {
+  for (size_t i = 0; i < m->fit_count; i++) {
+    if (m->fit[i]->open == 1) {
+      printf("FIT ENCONTRADO: %.*s\n", NAMESIZE, m->dir[m->fit[i]->entry].name);
+      printf("Modo: %d, Block Pointer: %d, Buffer Pointer: %d\n", m->fit[i]->mode, m->fit[i]->block_pointer, m->fit[i]->buffer_pointer);
+    }
+  }
+}
+
+// Funcao auxiliar que carrega o diretorio seguindo sua cadeia na fat a partir do cluster dir_start.
+// Trechos contiguos da cadeia sao lidos em uma unica chamada;
+int __fs_load_dir(fs_mount *m) {
+  int clusters = 1;
+  for (int c = m->dir_start; __fs_get_fat(m, c) != FAT_DIR_END && clusters <= m->clusters; c = __fs_get_fat(m, c)) {
+    clusters++;
+  }
+  m->dir_entries = 0;
+  if (!__fs_resize_dir(m, clusters)) return 0;
+
+  int c = m->dir_start;
+  for (int i = 0; i < clusters; i++) {
+    m->dir_clusters[i] = c;
+    c = __fs_get_fat(m, c);
+  }
+  memset(m->dir_dirty, 0, clusters * m->cluster_sectors);
+  for (int i = 0; i < clusters; ) {
+    int j = i + 1;
+    while (j < clusters && m->dir_clusters[j] == m->dir_clusters[j - 1] + 1) j++;
+    bl_read_range(m->dir_clusters[i] * m->cluster_sectors, (j - i) * m->cluster_sectors, (char *) (m->dir + i * m->dir_per_cluster));
+    i = j;
+  }
+  return __fs_build_dir_index(m);
+}
+
+// Funcao auxiliar que aumenta o diretorio em um cluster, de preferencia logo apos o seu ultimo cluster.
+// As novas entradas vao para a pilha de livres e o indice de nomes so e reconstruido quando a tabela
+// hash fica menor que o diretorio, o que mantem o custo amortizado da criacao constante;
+int __fs_grow_dir(fs_mount *m) {
+  int clusters = m->dir_entries / m->dir_per_cluster;
+  int ultimo = m->dir_clusters[clusters - 1];
+  int novo = __fs_next_free_fat(m, ultimo);
+  if (novo == -1) return 0;
+  if (!__fs_resize_dir(m, clusters + 1)) return 0;
+
+  __fs_set_fat(m, novo, FAT_DIR_END);
+  __fs_set_fat(m, ultimo, novo);
+  m->dir_clusters[clusters] = novo;
+
+  // O cluster novo ainda tem lixo no disco, entao todas as suas entradas vazias sao escritas, e com diario
+  // tambem vao na transacao;
+  for (int i = clusters * m->dir_per_cluster; i < m->dir_entries; i++) {
+    __fs_touch_dir(m, i);
+  }
+
+  if (m->dir_entries > m->name_nbuckets) return __fs_build_dir_index(m);
+
+  int *next = realloc(m->name_next, m->dir_entries * sizeof(int));
+  int *livres = realloc(m->free_entries, m->dir_entries * sizeof(int));
+  if (next != NULL) m->name_next = next;
+  if (livres != NULL) m->free_entries = livres;
+  if (next == NULL || livres == NULL) {
+    printf("Sem memória para o índice do diretório!⚠⚠⚠⚠⚠\n");
+    return 0;
+  }
+  for (int i = m->dir_entries - 1; i >= clusters * m->dir_per_cluster; i--) {
+    m->free_entries[m->free_entries_count++] = i;
+  }
+  return 1;
+}
+
+// Funcao auxiliar que carrega de um dispositivo o estado de uma montagem: fat, mapa de livres e diretorio;
+int __fs_load(fs_mount *m) {
+  // Lemos apenas o superbloco com a geometria e as estatisticas; as paginas da fat sao lidas conforme forem usadas, entao o
+  // custo da montagem nao depende do tamanho da imagem;
+  int valido = __fs_read_super(m);
+  if (!__fs_fat_reset(m)) return 0;
+
+  // Numa recarga os indices de extents e o desfragmentador da carga anterior nao valem mais;
+  for (int i = 0; i < m->dir_entries; i++) {
+    __fs_drop_extents(m, i);
+  }
+  m->defrag_entry = 0;
+  m->defrag_target = -1;
+  clock_gettime(CLOCK_MONOTONIC, &m->last_commit);
+
+  // Checa se o arquivo lido esta formatado ou não, uma unica vez por montagem;
+  m->formatted = valido && __fs_validate(m);
+  if (!m->formatted) {
+    printf("Sistema de arquivo não formatado!⚠⚠⚠⚠⚠\n");
+    // Mesmo sem formato valido mantemos um diretorio vazio em memoria ate o fs_format;
+    __fs_geometry(m, bl_size(), SECTORSIZE);
+    m->fat_sectors = 0;
+    m->dir_entries = 0;
+    if (!__fs_resize_dir(m, 1)) return 0;
+    m->dir_clusters[0] = m->dir_start;
+    m->dir_dirty[0] = 0;
+    return __fs_build_dir_index(m);
+  }
+
+  // Imagens formatadas com diario tem o seu primeiro cluster marcado na fat. As transacoes que ainda nao
+  // chegaram ao lugar sao reaplicadas: primeiro as entradas da fat, que podem ter aumentado o diretorio,
+  // depois as do dir ja carregado;
+  m->journal = m->journal_clusters > 0 && __fs_get_fat(m, m->journal_start) == FAT_JOURNAL;
+  m->journal_pos = 1;
+  __fs_journal_clear(m);
+  journal_record *registros = NULL;
+  int count = 0;
+  int transacoes = m->journal ? __fs_journal_read(m, &registros, &count) : 0;
+  for (int i = 0; i < count; i++) {
+    if (registros[i].kind == JOURNAL_FAT) __fs_put_entry(m, registros[i].index, registros[i].value);
+  }
+
+  // Sem um desligamento limpo as estatisticas do superbloco podem estar para tras e sao recontadas;
+  if (!m->super_clean) __fs_count_fat(m);
+
+  // Carregamos o diretorio com seu indice;
+  if (!__fs_load_dir(m)) {
+    free(registros);
+    return 0;
+  }
+  if (transacoes > 0) {
+    for (int i = 0; i < count; i++) {
+      if (registros[i].kind == JOURNAL_DIR && registros[i].index < m->dir_entries) {
+        m->dir[registros[i].index] = registros[i].entry;
+        m->dir_dirty[registros[i].index / DIRENTRIES] = 1;
+      }
+    }
+    printf("Diário reaplicado: %d transações\n", transacoes);
+
+    // Com o dir corrigido reconstruimos o indice e levamos tudo ao lugar com um checkpoint;
+    if (!__fs_build_dir_index(m)) {
+      free(registros);
+      return 0;
     }
+    __fs_checkpoint(m);
+  }
+  free(registros);
+
+  // A contagem de arquivos do superbloco tambem pode estar para tras, com ou sem transacoes reaplicadas;
+  if (!m->super_clean || transacoes > 0) {
+    m->files = 0;
+    for (int i = 0; i < m->dir_entries; i++) {
+      if (__fs_used(m, i)) m->files++;
+    }
+  }
+  return 1;
+}
+
+// Funcao auxiliar que libera toda a memoria de uma montagem;
+void __fs_free_mount(fs_mount *m) {
+  for (int i = 0; i < m->fit_count; i++) {
+    pthread_mutex_destroy(&m->fit[i]->lock);
+    free(m->fit[i]);
+  }
+  for (int i = 0; i < m->dir_entries; i++) {
+    free(m->extents[i].runs);
+  }
+  __fs_free_buffers(m);
+  free(m->slabs);
+  free(m->fit);
+  free(m->free_fits);
+  free(m->dir);
+  free(m->dir_clusters);
+  free(m->dir_dirty);
+  free(m->name_buckets);
+  free(m->name_next);
+  free(m->free_entries);
+  free(m->open_count);
+  free(m->open_writer);
+  free(m->extents);
+  free(m->dir_logged);
+  free(m->log_fat);
+  free(m->log_dir);
+  m->fat_sectors = 0;
+  __fs_fat_reset(m);
+  free(m->fat_pages);
+  pthread_mutex_destroy(&m->fat_lock);
+  pthread_rwlock_destroy(&m->meta_lock);
+  if (current_mount == m) current_mount = NULL;
+  if (default_mount == m) default_mount = NULL;
+  free(m);
+}
+
+fs_mount *fs_mount_device(bl_device *dev) {
+  // Monta o sistema de arquivos do dispositivo dado em uma nova montagem, sem alterar a montagem da thread;
+  fs_mount *m = calloc(1, sizeof(fs_mount));
+  if (m == NULL) {
+    printf("Sem memória para a montagem!⚠⚠⚠⚠⚠\n");
+    return NULL;
+  }
+  m->device = dev;
+  m->commit_policy = FS_COMMIT_CLUSTER;
+  pthread_rwlock_init(&m->meta_lock, NULL);
+  pthread_mutex_init(&m->fat_lock, NULL);
+
+  bl_device *anterior = bl_current();
+  bl_use(dev);
+  int ok = __fs_load(m);
+  bl_use(anterior);
+  if (!ok) {
+    __fs_free_mount(m);
+    return NULL;
+  }
+  return m;
+}
+
+int fs_unmount(fs_mount *m) {
+  // Fecha os descritores que ainda estao abertos, escreve os metadados e libera a montagem.
+  // Nenhuma outra thread pode estar usando a montagem;
+  bl_device *anterior = bl_current();
+  bl_use(m->device);
+  for (int i = 0; i < m->fit_count; i++) {
+    if (m->fit[i]->open != 1) continue;
+    __fs_flush_pending(m, m->fit[i]);
+    __fs_settle_chain(m, m->fit[i]);
+    __fs_close_fit(m, i);
+  }
+  if (__fs_check_format(m)) {
+    __fs_checkpoint(m);
+    if (!m->super_clean) __fs_write_super(m, 1);
+  }
+  bl_use(anterior);
+  __fs_free_mount(m);
+  return 1;
+}
+
+void fs_use(fs_mount *m) {
+  current_mount = m;
+}
+
+int fs_init() {
+  // Monta o dispositivo atual da thread. A montagem passa a ser a da thread e a padrao do processo;
+  // Se a thread ja tem uma montagem sobre esse dispositivo, ela e recarregada do disco;
+  fs_mount *m = current_mount != NULL ? current_mount : default_mount;
+  if (m != NULL && m->device == bl_current()) {
+    pthread_rwlock_wrlock(&m->meta_lock);
+    int ok = __fs_load(m);
+    pthread_rwlock_unlock(&m->meta_lock);
+    return ok;
   }
+  m = fs_mount_device(bl_current());
+  if (m == NULL) return 0;
+  default_mount = m;
+  current_mount = m;
+  return 1;
 }
 
-int fs_init() {
-  //Buffer aponta para fat.
-  char* buffer = (char *) fat;
-  for (size_t i = 0; i < 32; i++) {
-    // Cada chamada de bl_read le um setor inteiro, portanto precisamos somar esse valor ao multiplicador de indice.
-    bl_read(i, buffer+(i*SECTORSIZE));
+int __fs_format(fs_mount *m, int cluster_size) {
+  if (!__fs_valid_cluster(cluster_size)) {
+    printf("Tamanho de cluster inválido!⚠⚠⚠⚠⚠\n");
+    return 0;
   }
+  m->formatted = 0;
 
-  // Finaliza lendo o Setor do diretorio e carregando na memoria.
-  bl_read(32,(char*) dir);
 
-  // Checa se o arquivo lido esta formatado ou não;
-  if (!__fs_check_format()) {
-    printf("Sistema de arquivo não formatado!⚠⚠⚠⚠⚠\n");
+  // Iteradores abertos deixam de fazer sentido e sao fechados, assim como os indices de extents;
+  for (size_t i = 0; i < m->fit_count; i++) {
+    if (m->fit[i]->open == 1) __fs_close_fit(m, i);
+  }
+  for (size_t i = 0; i < m->dir_entries; i++) {
+    __fs_drop_extents(m, i);
+  }
+  m->defrag_entry = 0;
+  m->defrag_target = -1;
+
+  // Os buffers do pool tem o tamanho do cluster anterior, entao o pool e refeito sob demanda;
+  __fs_free_buffers(m);
+
+  // A geometria vem do tamanho da imagem e do cluster escolhido, com uma entrada de 32 bits na fat para
+  // cada cluster;
+  __fs_geometry(m, bl_size() / (cluster_size / SECTORSIZE), cluster_size);
+  if (m->data_start >= m->clusters) {
+    printf("Imagem pequena demais para ser formatada!⚠⚠⚠⚠⚠\n");
+    m->fat_sectors = 0;
+    return 0;
+  }
+  if (!__fs_fat_reset(m)) return 0;
+  m->journal = m->journal_clusters > 0;
+
+  // Escrevemos a fat inteira direto no disco, em lotes de setores: o superbloco e a propria fat ficam
+  // reservados, o primeiro cluster do diretorio recebe o valor de fim, o diario e marcado e o resto fica
+  // livre. Na tabela de referencias nenhum cluster e compartilhado. Ja sabemos quantos clusters livres
+  // cada pagina tem;
+  unsigned int *lote = malloc((size_t) WRITE_BATCH * SECTORSIZE);
+  if (lote == NULL) {
+    printf("Sem memória para formatar!⚠⚠⚠⚠⚠\n");
+    m->fat_sectors = 0;
+    return 0;
+  }
+  for (int p = 0; p < m->fat_sectors; p += WRITE_BATCH) {
+    int n = m->fat_sectors - p < WRITE_BATCH ? m->fat_sectors - p : WRITE_BATCH;
+    for (int i = 0; i < n * FATENTRIES; i++) {
+      int c = p * FATENTRIES + i;
+      if (c >= m->ref_start) {
+        lote[i] = 0;
+      } else if (c < m->dir_start || c >= m->clusters) {
+        lote[i] = FAT_RESERVED;
+      } else if (c == m->dir_start) {
+        lote[i] = FAT_DIR_END;
+      } else if (m->journal && c >= m->journal_start && c < m->journal_start + m->journal_clusters) {
+        lote[i] = FAT_JOURNAL;
+      } else {
+        lote[i] = FAT_FREE;
+      }
+      if (i % FATENTRIES == 0) m->fat_free[p + i / FATENTRIES] = 0;
+      if (lote[i] == FAT_FREE) m->fat_free[p + i / FATENTRIES]++;
+    }
+    bl_write_range(m->fat_start + p, n, (char *) lote);
+  }
+  free(lote);
+  m->free_clusters = 0;
+  for (int p = 0; p < m->fat_sectors; p++) {
+    m->free_clusters += m->fat_free[p];
+  }
+  m->files = 0;
+  m->fragments = 0;
+  m->super_clean = 0;
+
+  // Em memória populamos o dir, que volta a ter um unico cluster;
+  m->dir_entries = 0;
+  if (!__fs_resize_dir(m, 1)) return 0;
+  for (size_t i = 0; i < m->dir_per_cluster; i++) {
+    m->dir[i].name[0] = '\0';
+    m->dir[i].first_block = -1;
+    m->dir[i].size = 0;
+  }
+  m->dir_clusters[0] = m->dir_start;
+  if (!__fs_build_dir_index(m)) return 0;
+
+  // Escrevemos o dir no disco;
+  memset(m->dir_dirty, 1, m->cluster_sectors);
+  __fs_journal_clear(m);
+  __fs_write_fat_dir_disk(m);
+
+  // O diario comeca vazio: o cabecalho pede a transacao 1, e o primeiro setor de transacoes e zerado
+  // para que nenhuma transacao de uma formatacao anterior seja aceita;
+  if (m->journal) {
+    char setor[SECTORSIZE];
+    memset(setor, 0, SECTORSIZE);
+    bl_write_range(m->journal_start * m->cluster_sectors + 1, 1, setor);
+    m->journal_seq = 1;
+    m->journal_pos = 1;
+    __fs_journal_header(m);
   }
 
+  // Por ultimo o superbloco com a geometria, que torna a imagem formatada;
+  __fs_write_super(m, 1);
+  m->formatted = 1;
   return 1;
 }
 
-int fs_format() {
-  // Primeiro populamos a fat em memoria, primeiramente os 32 primeiros setores com o valor 3;
-  // Depois o setor 33 com o valor 4 de diretorio;
-  for (size_t i = 0; i < 32; i++) {
-    fat[i] = 3;
-  }
-  fat[32] = 4;
+int fs_format(int cluster_size) {
+  long inicio = __fs_clock();
+  fs_mount *m = __fs_current();
+  pthread_rwlock_wrlock(&m->meta_lock);
+  int r = __fs_format(m, cluster_size);
+  pthread_rwlock_unlock(&m->meta_lock);
+  __fs_op_done(m, FS_OP_FORMAT, inicio);
+  return r;
+}
 
-  // Para o resto da fat ate o bl_size, populamos com setor vazio;
-  for (size_t i = 33; i < bl_size(); i++) {
-    fat[i] = 1;
+int __fs_set_commit_policy(fs_mount *m, int policy, int interval_ms) {
+  if (policy != FS_COMMIT_CLUSTER && policy != FS_COMMIT_CLOSE && policy != FS_COMMIT_INTERVAL) {
+    printf("Politica de commit não suportada!⚠⚠⚠⚠⚠\n");
+    return 0;
+  }
+  if (policy == FS_COMMIT_INTERVAL && interval_ms < 0) {
+    printf("Intervalo de commit inválido!⚠⚠⚠⚠⚠\n");
+    return 0;
   }
-  
 
-  // Em memória populamos o dir;
-  for (size_t i = 0; i < DIRENTRIES; i++) {
-    dir[i].used = 0;
-    dir[i].name[0] = '\0';
-    dir[i].first_block = -1;
-    dir[i].size = 0;
+  // Ao trocar de politica escrevemos o que estava pendente, para nao herdar atrasos da politica anterior;
+  if (m->journal) {
+    __fs_journal_commit(m);
+  } else {
+    __fs_write_fat_dir_disk(m);
   }
+  m->commit_policy = policy;
+  m->commit_interval = interval_ms;
+  return 1;
+}
 
-  // Escrevemos a fat e o dir no disco;
-  __fs_write_fat_dir_disk();
+int fs_set_commit_policy(int policy, int interval_ms) {
+  fs_mount *m = __fs_current();
+  pthread_rwlock_wrlock(&m->meta_lock);
+  int r = __fs_set_commit_policy(m, policy, interval_ms);
+  pthread_rwlock_unlock(&m->meta_lock);
+  return r;
+}
 
+int __fs_sync(fs_mount *m) {
+  // Escreve incondicionalmente os metadados sujos no seu lugar, independente da politica, deixando o diario vazio;
+  // Com tudo no lugar o superbloco volta a ficar limpo, com as estatisticas atuais;
+  __fs_checkpoint(m);
+  if (m->formatted && !m->super_clean) __fs_write_super(m, 1);
   return 1;
 }
 
-int fs_free() {
+int fs_sync() {
+  long inicio = __fs_clock();
+  fs_mount *m = __fs_current();
+  pthread_rwlock_wrlock(&m->meta_lock);
+  int r = __fs_sync(m);
+  pthread_rwlock_unlock(&m->meta_lock);
+  __fs_op_done(m, FS_OP_SYNC, inicio);
+  return r;
+}
+
+long __fs_free(fs_mount *m) {
 
   // Checa se o arquivo lido esta formatado ou não;
-  if (!__fs_check_format()) {
+  if (!__fs_check_format(m)) {
     printf("Sistema de arquivo não formatado!⚠⚠⚠⚠⚠\n");
     return -1;
   }
 
-  // Para cada setor da fat livre somamos Clustersize bytes no total retornado;
-  int free_blocks = 0;
-  for (size_t i = 0; i < bl_size(); i++) {
-    if (fat[i] == 1) free_blocks++;
+  // A contagem de clusters livres e mantida a cada alteracao da fat;
+  return (long) m->free_clusters * m->cluster_size;
+}
+
+long fs_free() {
+  long inicio = __fs_clock();
+  fs_mount *m = __fs_current();
+  pthread_rwlock_rdlock(&m->meta_lock);
+  long r = __fs_free(m);
+  pthread_rwlock_unlock(&m->meta_lock);
+  __fs_op_done(m, FS_OP_FREE, inicio);
+  return r;
+}
+
+int __fs_statfs(fs_mount *m, fs_stats *stats) {
+
+  // Checa se o arquivo lido esta formatado ou não;
+  if (!__fs_check_format(m)) {
+    printf("Sistema de arquivo não formatado!⚠⚠⚠⚠⚠\n");
+    return 0;
   }
-  return free_blocks*CLUSTERSIZE;
+
+  stats->cluster_size = m->cluster_size;
+  stats->data_clusters = m->clusters - m->data_start - m->journal_clusters;
+  stats->free_clusters = m->free_clusters;
+  stats->files = m->files;
+  stats->fragments = m->fragments;
+  return 1;
 }
 
-int fs_list(char *buffer, int size) {
+int fs_statfs(fs_stats *stats) {
+  long inicio = __fs_clock();
+  fs_mount *m = __fs_current();
+  pthread_rwlock_rdlock(&m->meta_lock);
+  int r = __fs_statfs(m, stats);
+  pthread_rwlock_unlock(&m->meta_lock);
+  __fs_op_done(m, FS_OP_STATFS, inicio);
+  return r;
+}
+
+int __fs_list(fs_mount *m, char *buffer, int size) {
 
-  if (!__fs_check_format()) {
+  if (!__fs_check_format(m)) {
     printf("Sistema de arquivo não formatado!⚠⚠⚠⚠⚠\n");
     return 0;
   }
@@ -231,228 +2242,630 @@ int fs_list(char *buffer, int size) {
   // Criamos uma string temporaria que ira ser escrita no buffer;
   char temp[38];
 
-  // Como estamos utilizando strcat, para concatenar bytes como caracteres, devemos tratar o buffer
-  // fornecido como uma string, e por isso precisamos colocar uma terminação de string no buffer;
+  // O buffer fornecido e tratado como uma string, e por isso precisamos colocar uma terminação de string nele.
+  // Guardamos o tamanho ja escrito para concatenar sem percorrer o buffer, e paramos quando ele enche;
   buffer[0] = '\0';
-  for (size_t i = 0; i < DIRENTRIES; i++) {
-    if (dir[i].used == 1) {
+  int usado = 0;
+  for (size_t i = 0; i < m->dir_entries; i++) {
+    if (__fs_used(m, i)) {
       // Para cada arquivo utilizado, printamos seu formato na string temp.
-      sprintf(temp, "%s\t\t%d\n", dir[i].name, dir[i].size);
+      int n = sprintf(temp, "%.*s\t\t%d\n", NAMESIZE, m->dir[i].name, m->dir[i].size);
+      if (usado + n >= size) break;
       // Depois concatenamos no buffer.
-      strcat(buffer,temp);
+      memcpy(buffer + usado, temp, n + 1);
+      usado += n;
     } 
   }
 
   return 1;
 }
 
-int fs_create(char* file_name) {
-
-  if (!__fs_check_format()) {
-    printf("Sistema de arquivo não formatado!⚠⚠⚠⚠⚠\n");
-    return 0;
-  }
+int fs_list(char *buffer, int size) {
+  long inicio = __fs_clock();
+  fs_mount *m = __fs_current();
+  pthread_rwlock_rdlock(&m->meta_lock);
+  int r = __fs_list(m, buffer, size);
+  pthread_rwlock_unlock(&m->meta_lock);
+  __fs_op_done(m, FS_OP_LIST, inicio);
+  return r;
+}
 
-  int alvo = -1;
-  for (size_t i = 0; i < DIRENTRIES; i++) {
-    // Procuramos o primeiro local vazio.
-    if (dir[i].used == 0 && alvo == -1) alvo = i;
-    
-    // Caso encontremos um arquivo com o mesmo nome retornamos erro.
-    if(strcmp(dir[i].name, file_name) == 0 && dir[i].used == 1) {
-      printf("Arquivo já existe!⚠⚠⚠⚠⚠\n");
-      return 0;      
+int __fs_list_next(fs_mount *m, int *cursor, char *file_name, int *size) {
+  // Devolve o proximo arquivo a partir da entrada *cursor, avancando o cursor; retorna 0 no fim do diretorio;
+  while (*cursor < m->dir_entries) {
+    int i = (*cursor)++;
+    if (__fs_used(m, i)) {
+      __fs_entry_name(m, i, file_name);
+      *size = m->dir[i].size;
+      return 1;
     }
   }
+  return 0;
+}
 
-  // Se nao achamos espaco vazio retornamos e printamos erro.
-  if (alvo == -1) {
-    printf("ACABOU O ESPAÇO!⚠⚠⚠⚠⚠\n");
+int fs_list_next(int *cursor, char *file_name, int *size) {
+  long inicio = __fs_clock();
+  fs_mount *m = __fs_current();
+  pthread_rwlock_rdlock(&m->meta_lock);
+  int r = __fs_list_next(m, cursor, file_name, size);
+  pthread_rwlock_unlock(&m->meta_lock);
+  __fs_op_done(m, FS_OP_LIST_NEXT, inicio);
+  return r;
+}
+
+int __fs_create(fs_mount *m, char* file_name) {
+
+  if (!__fs_check_format(m)) {
+    printf("Sistema de arquivo não formatado!⚠⚠⚠⚠⚠\n");
     return 0;
   }
 
   // Efetuamos a checagem de tamanho de nome de arquivo.
   int tamanho_nome = strlen(file_name);
-  if(tamanho_nome > 24) {
+  if(tamanho_nome > NAMESIZE) {
     printf("Nome de arquivo muito grande!⚠⚠⚠⚠⚠\n");
     return 0;
   } 
 
-  // Populamos a estrutura de dir com as informacoes passadas.
-  strncpy(dir[alvo].name, file_name, tamanho_nome);
-  dir[alvo].name[tamanho_nome] = '\0';
-  dir[alvo].size = 0;
-  dir[alvo].used = 1;
+  // O nome vazio marca as entradas livres do dir;
+  if (tamanho_nome == 0) {
+    printf("Nome de arquivo vazio!⚠⚠⚠⚠⚠\n");
+    return 0;
+  }
+
+  // Caso encontremos um arquivo com o mesmo nome retornamos erro.
+  if (__fs_find_file(m, file_name) != -1) {
+    printf("Arquivo já existe!⚠⚠⚠⚠⚠\n");
+    return 0;      
+  }
+
   // Utilizamos a funcao auxiliar para buscar o proximo setor vazio na fat.
-  unsigned short target_block = __fs_next_free_fat();
+  int target_block = __fs_next_free_fat(m, -1);
   if (target_block == -1) {
     printf("ACABOU O ESPAÇO!⚠⚠⚠⚠⚠\n");
     return 0;
   }
-  dir[alvo].first_block = target_block;
+  __fs_set_fat(m, target_block, FAT_EOF);
+
+  // Pegamos uma entrada livre do diretorio, aumentando o diretorio se todas estiverem em uso.
+  if (m->free_entries_count == 0 && !__fs_grow_dir(m)) {
+    __fs_set_fat(m, target_block, FAT_FREE);
+    printf("ACABOU O ESPAÇO!⚠⚠⚠⚠⚠\n");
+    return 0;
+  }
+  int alvo = m->free_entries[--m->free_entries_count];
 
-  // Escrevemos na fat em memoria o setor ocupado.
-  fat[target_block] = 2;
+  // Populamos a estrutura de dir com as informacoes passadas.
+  strncpy(m->dir[alvo].name, file_name, NAMESIZE);
+  m->dir[alvo].size = 0;
+  m->files++;
+  m->dir[alvo].first_block = target_block;
+  __fs_touch_dir(m, alvo);
+  __fs_index_insert(m, alvo);
   
-  // Finalmente escrevemos no disco a fat.
-  __fs_write_fat_dir_disk();
+  // Finalmente passamos pelo ponto de commit.
+  __fs_commit(m, FS_COMMIT_CLOSE);
   return 1;
 }
 
-int fs_remove(char *file_name) {
+int fs_create(char *file_name) {
+  long inicio = __fs_clock();
+  fs_mount *m = __fs_current();
+  pthread_rwlock_wrlock(&m->meta_lock);
+  int r = __fs_create(m, file_name);
+  pthread_rwlock_unlock(&m->meta_lock);
+  __fs_op_done(m, FS_OP_CREATE, inicio);
+  return r;
+}
+
+int __fs_remove(fs_mount *m, char *file_name) {
 
-  if (!__fs_check_format()) {
+  if (!__fs_check_format(m)) {
     printf("Sistema de arquivo não formatado!⚠⚠⚠⚠⚠\n");
     return 0;
   }
 
-  for (size_t i = 0; i < DIRENTRIES; i++) {
-    // Procuramos o arquivo fornecido na estrutura de diretorio.
-    if(dir[i].used == 1 && strcmp(dir[i].name, file_name) == 0) {
-      dir[i].used = 0;
-      unsigned short target_block = dir[i].first_block;
-      unsigned short new_target;
-      do {
-        // Utilizamos new_target para iterar pelos blocos do arquivo na fat
-        // e modificamos para apontar setor vazio ate chegarmos no 2, que limpamos e saimos do loop.
-        new_target = fat[target_block];
-        fat[target_block] = 1;
-        target_block = new_target; 
-      } while (target_block != 2);
-      // Escrevemos a fat e dir no disco.
-      __fs_write_fat_dir_disk();
-      return 1;
+  // Procuramos o arquivo fornecido no indice do diretorio.
+  int i = __fs_find_file(m, file_name);
+  if (i == -1) {
+    printf("Arquivo não existe!⚠⚠⚠⚠⚠\n");
+    return 0;
+  }
+
+  if (m->open_count[i] > 0) {
+    printf("Arquivo está aberto!⚠⚠⚠⚠⚠\n");
+    return 0;
+  }
+
+  __fs_index_remove(m, i);
+  __fs_drop_extents(m, i);
+  __fs_defrag_forget(m, i);
+  m->free_entries[m->free_entries_count++] = i;
+  m->dir[i].name[0] = '\0';
+  m->files--;
+  __fs_touch_dir(m, i);
+  unsigned int target_block = m->dir[i].first_block;
+  unsigned int new_target;
+  do {
+    // Utilizamos new_target para iterar pelos blocos do arquivo na fat
+    // e modificamos para apontar setor vazio ate chegarmos no fim da cadeia, que limpamos e saimos do loop.
+    // Um cluster compartilhado com um clone apenas perde uma referencia e continua na cadeia do outro;
+    new_target = __fs_get_fat(m, target_block);
+    unsigned int refs = __fs_get_ref(m, target_block);
+    if (refs > 0) {
+      __fs_set_ref(m, target_block, refs - 1);
+    } else {
+      __fs_set_fat(m, target_block, FAT_FREE);
     }
+    target_block = new_target; 
+  } while (target_block != FAT_EOF);
+  // Passamos pelo ponto de commit.
+  __fs_commit(m, FS_COMMIT_CLOSE);
+  return 1;
+}
+
+int fs_remove(char *file_name) {
+  long inicio = __fs_clock();
+  fs_mount *m = __fs_current();
+  pthread_rwlock_wrlock(&m->meta_lock);
+  int r = __fs_remove(m, file_name);
+  pthread_rwlock_unlock(&m->meta_lock);
+  __fs_op_done(m, FS_OP_REMOVE, inicio);
+  return r;
+}
+
+int __fs_clone(fs_mount *m, char *src, char *dst) {
+
+  if (!__fs_check_format(m)) {
+    printf("Sistema de arquivo não formatado!⚠⚠⚠⚠⚠\n");
+    return 0;
   }
-  printf("Arquivo não existe!⚠⚠⚠⚠⚠\n");
-  return 0;
+
+  int origem = __fs_find_file(m, src);
+  if (origem == -1) {
+    printf("Arquivo não existe!⚠⚠⚠⚠⚠\n");
+    return 0;
+  }
+
+  // A cadeia de um arquivo sendo escrito ainda muda, entao ele nao pode ser clonado;
+  if (m->open_writer[origem]) {
+    printf("Arquivo está aberto para escrita!⚠⚠⚠⚠⚠\n");
+    return 0;
+  }
+
+  if (strlen(dst) > NAMESIZE || dst[0] == '\0') {
+    printf("Nome de arquivo muito grande!⚠⚠⚠⚠⚠\n");
+    return 0;
+  }
+  if (!strcmp(src, dst)) return 1;
+
+  // Como na abertura para escrita, um destino que ja existe e substituido;
+  if (__fs_find_file(m, dst) != -1 && !__fs_remove(m, dst)) return 0;
+
+  if (m->free_entries_count == 0 && !__fs_grow_dir(m)) {
+    printf("ACABOU O ESPAÇO!⚠⚠⚠⚠⚠\n");
+    return 0;
+  }
+
+  // O clone usa a mesma cadeia da origem: cada cluster dela ganha uma referencia, e nenhum dado e copiado.
+  // Uma cadeia compartilhada nao pode mais ser movida pelo desfragmentador.
+  // Todo cluster seguinte a um compartilhado tambem e compartilhado, pois as cadeias que chegam nele seguem
+  // juntas ate o fim;
+  __fs_defrag_forget(m, origem);
+  unsigned int bloco = m->dir[origem].first_block;
+  while (bloco != FAT_EOF) {
+    __fs_set_ref(m, bloco, __fs_get_ref(m, bloco) + 1);
+    bloco = __fs_get_fat(m, bloco);
+  }
+
+  int alvo = m->free_entries[--m->free_entries_count];
+  m->dir[alvo] = m->dir[origem];
+  strncpy(m->dir[alvo].name, dst, NAMESIZE);
+  m->files++;
+  __fs_touch_dir(m, alvo);
+  __fs_index_insert(m, alvo);
+
+  // Passamos pelo ponto de commit, que leva as referencias e a entrada do dir juntas;
+  __fs_commit(m, FS_COMMIT_CLOSE);
+  return 1;
 }
 
-int fs_open(char *file_name, int mode) {
+int fs_clone(char *src, char *dst) {
+  long inicio = __fs_clock();
+  fs_mount *m = __fs_current();
+  pthread_rwlock_wrlock(&m->meta_lock);
+  int r = __fs_clone(m, src, dst);
+  pthread_rwlock_unlock(&m->meta_lock);
+  __fs_op_done(m, FS_OP_CLONE, inicio);
+  return r;
+}
+
+int __fs_open(fs_mount *m, char *file_name, int mode) {
 
-  if (!__fs_check_format()) {
+  if (!__fs_check_format(m)) {
     printf("Sistema de arquivo não formatado!⚠⚠⚠⚠⚠\n");
     return -1;
   }
 
   if (mode == FS_R) {
-    int alvo = __fs_find_file(file_name);
+    int alvo = __fs_find_file(m, file_name);
 
     if (alvo == -1) {
       printf("Arquivo inexiste!⚠⚠⚠⚠⚠\n");
       return -1; 
     }
 
-    // Populamos o fit do arquivo;
-    fit[alvo].block_pointer = dir[alvo].first_block;
-    fit[alvo].open = 1;
-    fit[alvo].buffer_pointer = 0;
-    fit[alvo].mode = mode;
-    fit[alvo].gindex = 0;
-    return alvo;
+    // Varios leitores podem compartilhar o arquivo, mas nao enquanto ele esta sendo escrito;
+    if (m->open_writer[alvo]) {
+      printf("Arquivo está aberto para escrita!⚠⚠⚠⚠⚠\n");
+      return -1;
+    }
+
+    // Abrimos um novo fit para o arquivo;
+    int file = __fs_open_fit(m, alvo, mode);
+    if (file == -1) printf("Sem memória para abrir o arquivo!⚠⚠⚠⚠⚠\n");
+    return file;
+  }
+
+  // No acrescimo e na leitura e escrita o arquivo e mantido, e criado se ainda nao existe. Como na escrita,
+  // ninguem mais pode te-lo aberto;
+  if (mode == FS_A || mode == FS_RW) {
+    int alvo = __fs_find_file(m, file_name);
+    if (alvo == -1) {
+      if (!__fs_create(m, file_name)) return -1;
+      alvo = __fs_find_file(m, file_name);
+    }
+    if (m->open_count[alvo] > 0) {
+      printf("Arquivo está aberto!⚠⚠⚠⚠⚠\n");
+      return -1;
+    }
+
+    // O indice de extents acha o cluster do fim sem percorrer a cadeia, e fica montado para os proximos
+    // acrescimos. Como clones compartilham a cadeia inteira, ela e compartilhada se esse cluster for;
+    int file = -1;
+    if (__fs_build_extents(m, alvo)) file = __fs_open_fit(m, alvo, mode);
+    if (file == -1) {
+      printf("Sem memória para abrir o arquivo!⚠⚠⚠⚠⚠\n");
+      return -1;
+    }
+    file_iterator *f = m->fit[file];
+    int fim = __fs_extent_block(m, alvo, m->dir[alvo].size / m->cluster_size);
+    f->shared = __fs_get_ref(m, fim) > 0;
+
+    // No acrescimo o cursor parte desse cluster, com os bytes que ele ja tem no buffer;
+    if (mode == FS_A) {
+      f->block_pointer = fim;
+      f->buffer_base = m->dir[alvo].size % m->cluster_size;
+      f->buffer_pointer = f->buffer_base;
+      if (f->buffer_base > 0 && !__fs_read_cluster(m, fim, f->buffer)) {
+        printf("Erro de leitura no disco!⚠⚠⚠⚠⚠\n");
+        __fs_close_fit(m, file);
+        return -1;
+      }
+    }
+    return file;
   }
 
   // Se chegou aqui eh FS_W
   if (mode == FS_W) {
-    int alvo = __fs_find_file(file_name);
+    int alvo = __fs_find_file(m, file_name);
 
-    // Se o arquivo ja existe o removemos;
+    // Se o arquivo ja existe o removemos, o que so e possivel se ninguem o tem aberto;
     if (alvo != -1) {
-      fs_remove(file_name);
+      if (!__fs_remove(m, file_name)) return -1;
     }
 
     // Criamos um novo arquivo e o encontramos no dir;
-    fs_create(file_name);
-    alvo = __fs_find_file(file_name);
-
-    // Populamos o fit do arquivo;
-    fit[alvo].block_pointer = dir[alvo].first_block;
-    fit[alvo].mode = mode;
-    fit[alvo].buffer_pointer = 0;
-    fit[alvo].open = 1;
-    fit[alvo].gindex = 0;
+    if (!__fs_create(m, file_name)) {
+      return -1;
+    }
+    alvo = __fs_find_file(m, file_name);
 
-    __fs_write_fat_dir_disk();
-    return alvo;
+    // Abrimos um novo fit para o arquivo;
+    int file = __fs_open_fit(m, alvo, mode);
+    if (file == -1) printf("Sem memória para abrir o arquivo!⚠⚠⚠⚠⚠\n");
+    return file;
   }
 
   printf("Modo de abertura de arquivo não suportado!⚠⚠⚠⚠⚠");
   return -1;
 }
 
-int fs_close(int file)  {
+int fs_open(char *file_name, int mode) {
+  long inicio = __fs_clock();
+  fs_mount *m = __fs_current();
+  pthread_rwlock_wrlock(&m->meta_lock);
+  int r = __fs_open(m, file_name, mode);
+  pthread_rwlock_unlock(&m->meta_lock);
+  __fs_op_done(m, FS_OP_OPEN, inicio);
+  return r;
+}
 
-  if (!__fs_check_format()) {
-    printf("Sistema de arquivo não formatado!⚠⚠⚠⚠⚠\n");
-    return 0;
-  }
+int __fs_close(fs_mount *m, int file) {
   //precisa checar se o arquivo esta aberto
   //flush no buffer da fit do arquivo em questao
   //limpar as variaveis da fit para o novo uso caso aconteca
   //fecha
-  if (fit[file].open != 1) {
-    printf("Arquivo não está aberto!⚠⚠⚠⚠⚠");
-    return 0;
+  file_iterator *f = __fs_lock_fit(m, file, -1);
+  if (f == NULL) return 0;
+  int r = 1;
+
+  // Precisamos dar um ultimo flush caso ainda exista algo a ser escrito no buffer. Sem espaco o residuo
+  // e descartado, mas o descritor e fechado mesmo assim para nao ficar preso;
+  if(__fs_flush_pending(m, f) == 0){
+    printf("Não há mais espaço no disco para preencher o buffer residual!⚠⚠⚠⚠⚠\n");
+    r = 0;
   }
 
-  // Flush no buffer
-  if (fit[file].mode == FS_W) {
-    if (fit[file].buffer_pointer != 0) {
-      // Precisamos dar um ultimo flush caso ainda exista algo a ser escrito no buffer;
-      if(__fs_flush_fit(file, fit[file].buffer_pointer) == 0){
-        printf("Não há mais espaço no disco para preencher o buffer residual!⚠⚠⚠⚠⚠\n");
-        return 0;
+  pthread_rwlock_wrlock(&m->meta_lock);
+  // Acertamos a cadeia e passamos pelo ponto de commit do fechamento;
+  if (f->mode != FS_R) {
+    __fs_settle_chain(m, f);
+    __fs_commit(m, FS_COMMIT_CLOSE);
+  }
+
+  // Limpando variaveis da fit e devolvendo seu buffer ao pool;
+  __fs_close_fit(m, file);
+  pthread_rwlock_unlock(&m->meta_lock);
+  pthread_mutex_unlock(&f->lock);
+  return r;
+}
+
+int fs_close(int file)  {
+  long inicio = __fs_clock();
+  fs_mount *m = __fs_current();
+  int r = __fs_close(m, file);
+  __fs_op_done(m, FS_OP_CLOSE, inicio);
+  return r;
+}
+
+// Funcao auxiliar do fs_write, chamada com o lock do iterador;
+int __fs_write(fs_mount *m, file_iterator *f, char *buffer, int size) {
+  // Trechos menores que o buffer sao copiados para ele, e so quando ele enche os seus clusters sao atribuidos
+  // e escritos de uma vez, sem intercalar com os de outros arquivos escritos ao mesmo tempo.
+  // Trechos alinhados de pelo menos um buffer vao direto do buffer do usuario para o disco;
+  if (!__fs_own_chain(m, f, -1)) return -1;
+  int capacidade = f->buffer_clusters * m->cluster_size;
+  int escrito = 0;
+  while (escrito < size) {
+    int falta = size - escrito;
+
+    if (f->buffer_pointer == 0 && falta >= capacidade) {
+      int n = falta / m->cluster_size;
+      if (n > WRITE_BATCH) n = WRITE_BATCH;
+      if (__fs_write_direct(m, f, buffer + escrito, n) == 0) {
+        printf("Não há mais espaço no disco para dar flush!⚠⚠⚠⚠⚠\n");
+        return -1;
+      }
+      escrito += n * m->cluster_size;
+      continue;
+    }
+
+    int trecho = capacidade - f->buffer_pointer;
+    if (trecho > falta) trecho = falta;
+    memcpy(f->buffer + f->buffer_pointer, buffer + escrito, trecho);
+    f->buffer_pointer += trecho;
+    escrito += trecho;
+
+    // Caso o buffer pointer fique igual a capacidade chegamos no fim do buffer e no fim de um cluster,
+    // portanto efetuamos o flush de todo o buffer;
+    if (f->buffer_pointer == capacidade) {
+      if(__fs_flush_delayed(m, f) == 0){
+        printf("Não há mais espaço no disco para dar flush!⚠⚠⚠⚠⚠\n");
+        return -1;
       }
     }
   }
-  
+  return escrito;
+}
 
-  // Limpando variaveis da fit;
-  fit[file].block_pointer = 0;
-  fit[file].open = 0;
-  fit[file].buffer[0] = '\0';
-  fit[file].buffer_pointer = 0;
-  fit[file].mode = -1;
-  fit[file].gindex = 0;
-  return 1;
+int __fs_fallocate(fs_mount *m, file_iterator *f, int size) {
+  // A escrita no lugar nao tem clusters atrasados para onde levar a reserva;
+  if (f->mode == FS_RW) {
+    printf("Reserva só é possível em modo de escrita ou acréscimo!⚠⚠⚠⚠⚠\n");
+    return 0;
+  }
+  if (!__fs_own_chain(m, f, -1)) return 0;
+
+  // O bloco atual comeca no byte (tamanho - buffer_base) do arquivo. Para chegar a size bytes ele precisa ser
+  // seguido pelos clusters que cobrem o resto, ja que depois do ultimo dado sempre vem um bloco vazio. O
+  // tamanho vem do dir, que so e lido com o meta_lock;
+  pthread_rwlock_wrlock(&m->meta_lock);
+  int inicio = m->dir[f->entry].size - f->buffer_base;
+  int n = (size - inicio + m->cluster_size - 1) / m->cluster_size;
+  if (n <= 0) {
+    pthread_rwlock_unlock(&m->meta_lock);
+    return 1;
+  }
+  int *chain = malloc(n * sizeof(int));
+  if (chain == NULL) {
+    pthread_rwlock_unlock(&m->meta_lock);
+    printf("Sem memória para reservar o espaço!⚠⚠⚠⚠⚠\n");
+    return 0;
+  }
+  int ok = __fs_extend_chain(m, f->block_pointer, n, chain);
+  if (ok) __fs_commit(m, FS_COMMIT_CLUSTER);
+  pthread_rwlock_unlock(&m->meta_lock);
+  free(chain);
+  if (!ok) printf("Não há espaço no disco para a reserva!⚠⚠⚠⚠⚠\n");
+  return ok;
 }
 
-int fs_write(char *buffer, int size, int file) {
+int fs_fallocate(int file, int size) {
+  long inicio = __fs_clock();
+  fs_mount *m = __fs_current();
+  int r = 0;
+  file_iterator *f = __fs_lock_fit(m, file, FS_W);
+  if (f != NULL) {
+    r = __fs_fallocate(m, f, size);
+    pthread_mutex_unlock(&f->lock);
+  }
+  __fs_op_done(m, FS_OP_FALLOCATE, inicio);
+  return r;
+}
 
-  if (!__fs_check_format()) {
-    printf("Sistema de arquivo não formatado!⚠⚠⚠⚠⚠\n");
-    return -1;
+int fs_write(char *buffer, int size, int file) {
+  long inicio = __fs_clock();
+  fs_mount *m = __fs_current();
+  int escrito = -1;
+  file_iterator *f = __fs_lock_fit(m, file, FS_W);
+  if (f != NULL) {
+    escrito = f->mode == FS_RW ? __fs_overwrite(m, f, buffer, size) : __fs_write(m, f, buffer, size);
+    pthread_mutex_unlock(&f->lock);
   }
+  __fs_op_done(m, FS_OP_WRITE, inicio);
+  return escrito;
+}
 
-  if (fit[file].open != 1 || fit[file].mode != FS_W) {
-    printf("Arquivo não está aberto ou não está em modo de escrita!⚠⚠⚠⚠⚠");
-    return -1;
+// Funcao auxiliar de leitura antecipada. Enquanto o arquivo e lido sequencialmente seguimos a cadeia da fat
+// a frente do cursor e pedimos ao disco os proximos clusters, dobrando a janela de RA_MIN ate RA_MAX a cada
+// reposicao. Com clusters maiores que um setor os limites valem em setores, para nao antecipar mais do que
+// cabe na cache do disco. Um acesso fora de sequencia zera a janela, e a antecipacao so volta com acessos
+// sequenciais;
+// A cadeia de um arquivo aberto para leitura nao muda, entao ela e seguida sem o meta_lock;
+void __fs_readahead(fs_mount *m, file_iterator *f, int tamanho) {
+  if (f->gindex != f->ra_next) {
+    f->ra_window = 0;
+    f->ra_block = -1;
+    f->ra_index = -1;
+    return;
   }
-  
-  // Para cada byte escrito, copiamos o byte fornecido ao buffer do arquivo, aumentamos o buffer pointer
-  // Caso o buffer pointer fique igual CLUSTERSIZE chegamos no fim do buffer e no fim de um setor,
-  // portanto efetuamos o flush com a quantidade do buffer_pointer, para aumentar a quantidade do arquivo corretamente;
-  size_t i;
-  for (i = 0; i < size; i++) {
-    fit[file].buffer[fit[file].buffer_pointer] = buffer[i];
-    fit[file].buffer_pointer++;
-    if (fit[file].buffer_pointer == CLUSTERSIZE) {
-      if(__fs_flush_fit(file, fit[file].buffer_pointer) == 0){
-        printf("Não há mais espaço no disco para dar flush!⚠⚠⚠⚠⚠\n");
-        return -1;
-      }
+  int minimo = RA_MIN / m->cluster_sectors;
+  int maximo = RA_MAX / m->cluster_sectors;
+  if (minimo < 1) minimo = 1;
+  if (maximo < 1) maximo = 1;
+  if (f->ra_window == 0) f->ra_window = minimo;
+
+  // Cluster onde esta o proximo byte a ser lido;
+  int atual = f->gindex / m->cluster_size;
+  int bloco = f->block_pointer;
+  if (f->buffer_pointer == m->cluster_size) bloco = __fs_get_fat(m, bloco);
+
+  // Se ainda temos ao menos meia janela antecipada a frente nao fazemos nada, senao continuamos de onde paramos;
+  int indice = atual;
+  if (f->ra_block != -1 && f->ra_index >= atual) {
+    if (f->ra_index - atual >= f->ra_window / 2) return;
+    indice = f->ra_index + 1;
+    bloco = __fs_get_fat(m, f->ra_block);
+  }
+
+  int clusters = (tamanho + m->cluster_size - 1) / m->cluster_size;
+  int limite = atual + f->ra_window;
+  if (limite > clusters) limite = clusters;
+
+  // Trechos contiguos da cadeia sao pedidos de uma vez;
+  while (indice < limite && bloco != FAT_EOF) {
+    int primeiro = bloco;
+    int n = 1;
+    while (indice + n < limite && __fs_get_fat(m, bloco) == bloco + 1) {
+      bloco++;
+      n++;
     }
+    bl_prefetch(primeiro * m->cluster_sectors, n * m->cluster_sectors);
+    f->ra_block = bloco;
+    f->ra_index = indice + n - 1;
+    indice += n;
+    bloco = __fs_get_fat(m, bloco);
   }
-  return i;
+
+  f->ra_window *= 2;
+  if (f->ra_window > maximo) f->ra_window = maximo;
 }
 
-int fs_read(char *buffer, int size, int file) {
+// Funcao auxiliar do fs_read, chamada com o lock do iterador;
+int __fs_read(fs_mount *m, file_iterator *f, char *buffer, int size) {
+  // O dir pode crescer (e mudar de endereco) por outra thread, entao lemos o tamanho com o meta_lock;
+  pthread_rwlock_rdlock(&m->meta_lock);
+  int tamanho = m->dir[f->entry].size;
+  pthread_rwlock_unlock(&m->meta_lock);
 
-  if (!__fs_check_format()) {
-    printf("Sistema de arquivo não formatado!⚠⚠⚠⚠⚠\n");
-    return -1;
+  // Nunca lemos alem do fim do arquivo;
+  int restante = tamanho - f->gindex;
+  if (size > restante) size = restante;
+
+  if (size > 0) __fs_readahead(m, f, tamanho);
+
+  // Enquanto qtd de bytes lidos for menor que o tamanho pedido. Se o disco falhar paramos e devolvemos o
+  // que ja foi lido, ou -1 se nada foi;
+  int qtd = 0;
+  int erro = 0;
+  while (qtd < size) {
+
+    // Se estamos no bloco EOF acabamos o loop;
+    if (f->block_pointer == FAT_EOF) {
+      break;
+    }
+
+    // Se o bloco atual ja foi consumido passamos para o proximo bloco do arquivo e resetamos o buffer pointer;
+    if (f->buffer_pointer == m->cluster_size) {
+      f->block_pointer = __fs_get_fat(m, f->block_pointer);
+      f->buffer_pointer = 0;
+      f->buffer_valid = 0;
+      continue;
+    }
+
+    int falta = size - qtd;
+
+    // Se estamos no inicio de um bloco e o usuario pediu ao menos um bloco inteiro, lemos direto no buffer dele.
+    // Seguimos a cadeia agrupando trechos contiguos no disco, cada um lido em uma chamada, com varios
+    // trechos em voo ao mesmo tempo no motor assincrono;
+    // Se alguma leitura falhou o cursor volta para o inicio do trecho e devolvemos o que ja foi lido antes dele;
+    if (f->buffer_pointer == 0 && falta >= m->cluster_size) {
+      int n = falta / m->cluster_size;
+      int tags[AIO_INFLIGHT];
+      int pendentes = 0;
+      int lidos = 0;
+      int ok = 1;
+      int bloco = f->block_pointer;
+      while (1) {
+        int primeiro = f->block_pointer;
+        int k = 1;
+        while (lidos + k < n && __fs_get_fat(m, f->block_pointer) == f->block_pointer + 1) {
+          f->block_pointer++;
+          k++;
+        }
+        if (!__fs_submit(m, 0, primeiro, k, buffer + qtd + (size_t) lidos * m->cluster_size, tags, &pendentes)) ok = 0;
+        lidos += k;
+        if (lidos == n) break;
+        f->block_pointer = __fs_get_fat(m, f->block_pointer);
+      }
+      if (!__fs_wait_all(tags, &pendentes)) ok = 0;
+      if (!ok) {
+        f->block_pointer = bloco;
+        printf("Erro de leitura no disco!⚠⚠⚠⚠⚠\n");
+        erro = 1;
+        break;
+      }
+      qtd += n * m->cluster_size;
+      f->gindex += n * m->cluster_size;
+      f->buffer_pointer = m->cluster_size;
+      f->buffer_valid = 0;
+      continue;
+    }
+
+    // Caso contrario lemos o bloco atual para o buffer do arquivo, apenas se ele ainda nao esta la;
+    if (!f->buffer_valid) {
+      if (!__fs_read_cluster(m, f->block_pointer, f->buffer)) {
+        printf("Erro de leitura no disco!⚠⚠⚠⚠⚠\n");
+        erro = 1;
+        break;
+      }
+      f->buffer_valid = 1;
+    }
+
+    // E copiamos de uma vez o trecho que vai do cursor ate o fim do bloco ou do pedido;
+    int trecho = m->cluster_size - f->buffer_pointer;
+    if (trecho > falta) trecho = falta;
+    memcpy(buffer + qtd, f->buffer + f->buffer_pointer, trecho);
+    qtd += trecho;
+    f->buffer_pointer += trecho;
+    f->gindex += trecho;
   }
+  f->ra_next = f->gindex;
+  return erro && qtd == 0 ? -1 : qtd;
+}
 
+int fs_read(char *buffer, int size, int file) {
   //checar se esta open e modo READ
   //brincar com o buffer da fit
   //tomar cuidado para nao devolver lixo
@@ -460,42 +2873,323 @@ int fs_read(char *buffer, int size, int file) {
   //leia apenas ate EOF e mande o usuario burro tomar no cu
   //ate mesmo se vc ja estiver no fim, nao leia nada retorne zero como um chad
   //retorna a quantidade de bytes lidos
-  if (fit[file].open != 1 || fit[file].mode != FS_R) {
-    printf("Arquivo não está aberto ou não está em modo de leitura!⚠⚠⚠⚠⚠");
+  long inicio = __fs_clock();
+  fs_mount *m = __fs_current();
+  int qtd = -1;
+  file_iterator *f = __fs_lock_fit(m, file, FS_R);
+  if (f != NULL) {
+    // Na leitura e escrita o cluster alterado volta ao disco antes, para a leitura o ver;
+    if (__fs_rw_flush(m, f)) qtd = __fs_read(m, f, buffer, size);
+    pthread_mutex_unlock(&f->lock);
+  }
+  __fs_op_done(m, FS_OP_READ, inicio);
+  return qtd;
+}
+
+// Funcao auxiliar do fs_seek, chamada com o lock do iterador. O indice de extents e compartilhado entre
+// os leitores do arquivo: consultado com o meta_lock para leitura e montado com ele para escrita;
+int __fs_seek(fs_mount *m, file_iterator *f, int offset) {
+  int entry = f->entry;
+  pthread_rwlock_rdlock(&m->meta_lock);
+  if (offset < 0 || offset > m->dir[entry].size) {
+    pthread_rwlock_unlock(&m->meta_lock);
+    printf("Posição fora do arquivo!⚠⚠⚠⚠⚠\n");
     return -1;
   }
+  if (m->extents[entry].runs == NULL) {
+    pthread_rwlock_unlock(&m->meta_lock);
+    pthread_rwlock_wrlock(&m->meta_lock);
+    if (!__fs_build_extents(m, entry)) {
+      pthread_rwlock_unlock(&m->meta_lock);
+      printf("Sem memória para o índice do arquivo!⚠⚠⚠⚠⚠\n");
+      return -1;
+    }
+  }
+
+  // Posicionamos o cursor como o fs_read o deixaria: no inicio de um bloco o cursor fica no fim do bloco
+  // anterior, que so e trocado pelo proximo na leitura seguinte;
+  int bloco;
+  int pointer;
+  if (offset > 0 && offset % m->cluster_size == 0) {
+    bloco = __fs_extent_block(m, entry, offset / m->cluster_size - 1);
+    pointer = m->cluster_size;
+  } else {
+    bloco = __fs_extent_block(m, entry, offset / m->cluster_size);
+    pointer = offset % m->cluster_size;
+  }
+  pthread_rwlock_unlock(&m->meta_lock);
+
+  // O conteudo do buffer continua valido se o cursor permanece no mesmo bloco;
+  if (bloco != f->block_pointer) f->buffer_valid = 0;
+  f->block_pointer = bloco;
+  f->buffer_pointer = pointer;
+  f->gindex = offset;
+  return offset;
+}
 
-  // Enquanto qtd de bytes lidos for menor que o tamanho passado pelo usuario ou tamanho do arquivo;
-  size_t qtd = 0;
-  while(qtd < size && qtd < dir[file].size) {
+int fs_seek(int file, int offset) {
+  long inicio = __fs_clock();
+  fs_mount *m = __fs_current();
+  int r = -1;
+  file_iterator *f = __fs_lock_fit(m, file, FS_R);
+  if (f != NULL) {
+    if (__fs_rw_flush(m, f)) r = __fs_seek(m, f, offset);
+    pthread_mutex_unlock(&f->lock);
+  }
+  __fs_op_done(m, FS_OP_SEEK, inicio);
+  return r;
+}
 
-    // Se estamos no bloco EOF acabamos o loop;
-    if (fit[file].block_pointer == 2) {
-      break;
-    }
+int fs_pread(int file, char *buffer, int size, int offset) {
+  long inicio = __fs_clock();
+  fs_mount *m = __fs_current();
+  file_iterator *f = __fs_lock_fit(m, file, FS_R);
+  if (f == NULL) {
+    __fs_op_done(m, FS_OP_PREAD, inicio);
+    return -1;
+  }
 
-    // Lemos o bloco atual do arquivo para o buffer do mesmo
-    bl_read(fit[file].block_pointer, fit[file].buffer);
+  // Guardamos o cursor, lemos na posicao pedida e devolvemos o cursor ao lugar, como o pread do posix.
+  // Tudo com o lock do iterador, entao nenhuma outra operacao no descritor ve o cursor deslocado;
+  int block_pointer = f->block_pointer;
+  int buffer_pointer = f->buffer_pointer;
+  int gindex = f->gindex;
+  int ra_next = f->ra_next;
+  int ra_window = f->ra_window;
+  int ra_block = f->ra_block;
+  int ra_index = f->ra_index;
+  int qtd = -1;
+  if (__fs_rw_flush(m, f) && __fs_seek(m, f, offset) != -1) qtd = __fs_read(m, f, buffer, size);
+
+  f->buffer_valid = f->buffer_valid && f->block_pointer == block_pointer;
+  f->block_pointer = block_pointer;
+  f->buffer_pointer = buffer_pointer;
+  f->gindex = gindex;
+  f->ra_next = ra_next;
+  f->ra_window = ra_window;
+  f->ra_block = ra_block;
+  f->ra_index = ra_index;
+  pthread_mutex_unlock(&f->lock);
+  __fs_op_done(m, FS_OP_PREAD, inicio);
+  return qtd;
+}
+
+// Funcao auxiliar que percorre a cadeia de uma entrada e soma em frag seus clusters e seus extents, os
+// trechos contiguos no disco. Devolve 1 se algum cluster da cadeia e compartilhado com um clone;
+int __fs_chain_shape(fs_mount *m, int entry, fs_frag *frag) {
+  int clusters = 0;
+  int extents = 0;
+  int compartilhada = 0;
+  unsigned int anterior = FAT_EOF;
+  unsigned int bloco = m->dir[entry].first_block;
+  while (bloco != FAT_EOF) {
+    if (bloco != anterior + 1) extents++;
+    if (__fs_get_ref(m, bloco) > 0) compartilhada = 1;
+    clusters++;
+    anterior = bloco;
+    bloco = __fs_get_fat(m, bloco);
+  }
+  frag->files++;
+  if (extents > 1) frag->fragmented_files++;
+  if (extents > frag->max_extents) frag->max_extents = extents;
+  frag->clusters += clusters;
+  frag->extents += extents;
+  return compartilhada;
+}
 
-    // Enquanto o buffer pointer não chegou ao fim, a qtd de bytes não chegou ao tamanho passado, e o indice
-    // global do arquivo não chegou ao tamanho do mesmo:
-    while(fit[file].buffer_pointer < CLUSTERSIZE && qtd < size && fit[file].gindex < dir[file].size) {
-      // Lemos um byte do arquivo, aumentamos a qtd de bytes lidos, o pointer do buffer e o indice global do arquivo;
-      strncpy(buffer+qtd, &fit[file].buffer[fit[file].buffer_pointer], 1);
-      qtd++;
-      fit[file].buffer_pointer++;
-      fit[file].gindex++;
+int __fs_fragmentation(fs_mount *m, char *file_name, fs_frag *frag) {
+  if (!__fs_check_format(m)) {
+    printf("Sistema de arquivo não formatado!⚠⚠⚠⚠⚠\n");
+    return 0;
+  }
+  memset(frag, 0, sizeof(fs_frag));
+  if (file_name != NULL) {
+    int alvo = __fs_find_file(m, file_name);
+    if (alvo == -1) {
+      printf("Arquivo não existe!⚠⚠⚠⚠⚠\n");
+      return 0;
     }
+    __fs_chain_shape(m, alvo, frag);
+    return 1;
+  }
+  for (int i = 0; i < m->dir_entries; i++) {
+    if (__fs_used(m, i)) __fs_chain_shape(m, i, frag);
+  }
+  return 1;
+}
+
+int fs_fragmentation(char *file_name, fs_frag *frag) {
+  long inicio = __fs_clock();
+  fs_mount *m = __fs_current();
+  pthread_rwlock_rdlock(&m->meta_lock);
+  int r = __fs_fragmentation(m, file_name, frag);
+  pthread_rwlock_unlock(&m->meta_lock);
+  __fs_op_done(m, FS_OP_FRAG, inicio);
+  return r;
+}
+
+// Funcao auxiliar que prepara a mudanca da cadeia de uma entrada para uma faixa contigua de clusters livres,
+// procurada a partir do cluster onde o arquivo comeca. Arquivos abertos, ja contiguos ou que compartilham a
+// cadeia com um clone ficam onde estao, assim como os que nao cabem em nenhuma faixa livre;
+int __fs_defrag_plan(fs_mount *m, int entry) {
+  if (!__fs_used(m, entry) || m->open_count[entry] > 0) return 0;
+  fs_frag frag;
+  memset(&frag, 0, sizeof(fs_frag));
+  if (__fs_chain_shape(m, entry, &frag) || frag.extents <= 1) return 0;
+  int faixa = __fs_find_run(m, m->dir[entry].first_block, frag.clusters);
+  if (faixa == -1) return 0;
+  m->defrag_target = faixa;
+  m->defrag_clusters = frag.clusters;
+  m->defrag_done = 0;
+  return 1;
+}
+
+// Funcao auxiliar que move o proximo lote de ate limite clusters do arquivo em movimento para a faixa de
+// destino. Os dados sao copiados primeiro, para clusters ainda livres na fat, e sincronizados; so depois a
+// cadeia passa a usar as copias e os originais sao liberados, tudo no mesmo commit. Uma queda no meio deixa
+// a cadeia antiga ou a nova, nunca uma mistura. Se o arquivo foi aberto, a faixa deixou de estar livre
+// desde o lote anterior ou o disco falhou, retorna -1 e o arquivo fica como esta. Chamada com o meta_lock
+// para escrita;
+int __fs_defrag_batch(fs_mount *m, int limite) {
+  int entry = m->defrag_entry;
+  int k = m->defrag_clusters - m->defrag_done;
+  int maximo = DELAY_BYTES / m->cluster_size;
+  if (maximo > WRITE_BATCH) maximo = WRITE_BATCH;
+  if (maximo < 1) maximo = 1;
+  if (k > maximo) k = maximo;
+  if (k > limite) k = limite;
+  if (m->open_count[entry] > 0) return -1;
+
+  int destino = m->defrag_target + m->defrag_done;
+  for (int j = 0; j < k; j++) {
+    if (__fs_get_fat(m, destino + j) != FAT_FREE) return -1;
+  }
+
+  // Os clusters a mover continuam onde o ultimo lote parou: a copia do cluster anterior ainda aponta para eles;
+  int origem[WRITE_BATCH];
+  unsigned int bloco = m->defrag_done == 0 ? m->dir[entry].first_block : __fs_get_fat(m, destino - 1);
+  for (int j = 0; j < k; j++) {
+    if (bloco == FAT_EOF) return -1;
+    origem[j] = bloco;
+    bloco = __fs_get_fat(m, bloco);
+  }
+
+  char *dados = malloc((size_t) k * m->cluster_size);
+  if (dados == NULL) {
+    printf("Sem memória para desfragmentar!⚠⚠⚠⚠⚠\n");
+    return -1;
+  }
+  int tags[AIO_INFLIGHT];
+  int pendentes = 0;
+  int ok = 1;
+  for (int j = 0, n = 1; j < k; j += n) {
+    for (n = 1; j + n < k && origem[j + n] == origem[j + n - 1] + 1; n++);
+    if (!__fs_submit(m, 0, origem[j], n, dados + (size_t) j * m->cluster_size, tags, &pendentes)) ok = 0;
+  }
+  if (!__fs_wait_all(tags, &pendentes)) ok = 0;
+  if (ok && !__fs_submit(m, 1, destino, k, dados, tags, &pendentes)) ok = 0;
+  if (!__fs_wait_all(tags, &pendentes)) ok = 0;
+  if (ok) ok = bl_sync();
+  free(dados);
+  if (!ok) {
+    printf("Erro de E/S ao desfragmentar!⚠⚠⚠⚠⚠\n");
+    return -1;
+  }
+
+  for (int j = 0; j < k - 1; j++) {
+    __fs_set_fat(m, destino + j, destino + j + 1);
+  }
+  __fs_set_fat(m, destino + k - 1, bloco);
+  if (m->defrag_done == 0) {
+    m->dir[entry].first_block = destino;
+    __fs_touch_dir(m, entry);
+  } else {
+    __fs_set_fat(m, destino - 1, destino);
+  }
+  for (int j = 0; j < k; j++) {
+    __fs_set_fat(m, origem[j], FAT_FREE);
+  }
+  __fs_drop_extents(m, entry);
+  m->defrag_done += k;
+  __fs_commit(m, FS_COMMIT_CLOSE);
+  return k;
+}
 
-    // Se chegamos a alguma condição final da leitura paramos o loop;
-    if (qtd == size || fit[file].gindex == dir[file].size) {
+// Funcao auxiliar do fs_defrag_step: continua o movimento em curso e escolhe os proximos arquivos pela ordem do
+// dir, ate mover limite clusters ou dar uma volta inteira no dir sem achar o que mover. O meta_lock e tomado
+// para escrita a cada lote e solto depois dele, entao as outras operacoes esperam no maximo um lote de ate
+// DELAY_BYTES, qualquer que seja o tamanho do cluster;
+int __fs_defrag_step(fs_mount *m, int limite) {
+  int movidos = 0;
+  int examinadas = 0;
+  while (movidos < limite) {
+    pthread_rwlock_wrlock(&m->meta_lock);
+    if (!__fs_check_format(m)) {
+      pthread_rwlock_unlock(&m->meta_lock);
+      printf("Sistema de arquivo não formatado!⚠⚠⚠⚠⚠\n");
+      return -1;
+    }
+    while (m->defrag_target == -1 && examinadas < m->dir_entries) {
+      examinadas++;
+      if (m->defrag_entry >= m->dir_entries) m->defrag_entry = 0;
+      if (!__fs_defrag_plan(m, m->defrag_entry)) m->defrag_entry++;
+    }
+    if (m->defrag_target == -1) {
+      pthread_rwlock_unlock(&m->meta_lock);
       break;
     }
-    
-    // Se não temos que passar para o proximo bloco do arquivo e resetar o buffer pointer do mesmo;
-    fit[file].block_pointer = fat[fit[file].block_pointer];
-    fit[file].buffer_pointer = 0;
+    int k = __fs_defrag_batch(m, limite - movidos);
+    if (k > 0) movidos += k;
+    if (k == -1 || m->defrag_done == m->defrag_clusters) {
+      m->defrag_target = -1;
+      m->defrag_entry++;
+    }
+    pthread_rwlock_unlock(&m->meta_lock);
+  }
+  return movidos;
+}
+
+int fs_defrag_step(int limite) {
+  long inicio = __fs_clock();
+  fs_mount *m = __fs_current();
+  int r = __fs_defrag_step(m, limite);
+  __fs_op_done(m, FS_OP_DEFRAG, inicio);
+  return r;
+}
+
+int fs_defrag() {
+  // Passos de DEFRAG_STEP clusters ate nao haver mais o que mover; o meta_lock ja e solto entre os lotes;
+  long inicio = __fs_clock();
+  fs_mount *m = __fs_current();
+  int total = 0;
+  int r;
+  do {
+    r = __fs_defrag_step(m, DEFRAG_STEP);
+    if (r > 0) total += r;
+  } while (r > 0);
+  __fs_op_done(m, FS_OP_DEFRAG, inicio);
+  return r == -1 ? -1 : total;
+}
+
+void fs_get_counters(fs_counters *counters) {
+  // Os contadores sao copiados um a um, ja que sao atualizados atomicamente sem lock;
+  fs_mount *m = __fs_current();
+  long *origem = (long *) &m->counters;
+  long *destino = (long *) counters;
+  for (int i = 0; i < sizeof(fs_counters) / sizeof(long); i++) {
+    destino[i] = __atomic_load_n(&origem[i], __ATOMIC_RELAXED);
   }
-  return qtd;
 }
 
+void fs_reset_counters() {
+  fs_mount *m = __fs_current();
+  long *contadores = (long *) &m->counters;
+  for (int i = 0; i < sizeof(fs_counters) / sizeof(long); i++) {
+    __atomic_store_n(&contadores[i], 0, __ATOMIC_RELAXED);
+  }
+}
+
+char *fs_op_name(int op) {
+  if (op < 0 || op >= FS_OPS) return NULL;
+  return op_names[op];
+}
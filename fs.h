@@ -20,16 +20,104 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+// Modos do fs_open: leitura, escrita do zero, acrescimo ao fim e leitura e escrita no lugar. Os dois ultimos
+// mantem o conteudo do arquivo, e o criam se ele ainda nao existe;
 #define FS_R 0
 #define FS_W 1
+#define FS_A 2
+#define FS_RW 3
+
+// Politicas de commit dos metadados (fat e dir) no disco;
+#define FS_COMMIT_CLUSTER 0
+#define FS_COMMIT_CLOSE 1
+#define FS_COMMIT_INTERVAL 2
+
+// Tamanhos de cluster aceitos pelo fs_format: multiplos do setor ate FS_CLUSTER_MAX;
+#define FS_CLUSTER_DEFAULT 4096
+#define FS_CLUSTER_MAX (1024 * 1024)
+
+// Estatisticas do volume, mantidas a cada alteracao e guardadas no superbloco: clusters da area de dados,
+// quantos estao livres, arquivos no diretorio e descontinuidades nas cadeias dos arquivos;
+typedef struct {
+  int cluster_size;
+  int data_clusters;
+  int free_clusters;
+  int files;
+  int fragments;
+} fs_stats;
+
+// Fragmentacao de um arquivo ou do volume, medida percorrendo as cadeias: arquivos medidos, quantos tem mais
+// de um extent (trecho contiguo no disco), clusters e extents somados e o maior numero de extents de um
+// arquivo. O comprimento medio de um trecho e clusters / extents;
+typedef struct {
+  int files;
+  int fragmented_files;
+  long clusters;
+  long extents;
+  int max_extents;
+} fs_frag;
+
+// Chamadas da API instrumentadas, com um histograma de latencia cada nos contadores da montagem;
+#define FS_OP_FORMAT 0
+#define FS_OP_SYNC 1
+#define FS_OP_FREE 2
+#define FS_OP_STATFS 3
+#define FS_OP_LIST 4
+#define FS_OP_LIST_NEXT 5
+#define FS_OP_CREATE 6
+#define FS_OP_REMOVE 7
+#define FS_OP_OPEN 8
+#define FS_OP_CLOSE 9
+#define FS_OP_WRITE 10
+#define FS_OP_READ 11
+#define FS_OP_SEEK 12
+#define FS_OP_PREAD 13
+#define FS_OP_CLONE 14
+#define FS_OP_FALLOCATE 15
+#define FS_OP_FRAG 16
+#define FS_OP_DEFRAG 17
+#define FS_OPS 18
+
+// Contadores de desempenho de uma montagem: a latencia de cada chamada da API, das escritas dos metadados
+// no lugar e dos commits do diario, em nanossegundos, os setores de metadados escritos no lugar e quantas
+// entradas da fat o alocador examina a cada cluster alocado;
+typedef struct {
+  bl_histogram ops[FS_OPS];
+  bl_histogram flushes;
+  bl_histogram commits;
+  bl_histogram alloc_scan;
+  long flushed_sectors;
+} fs_counters;
+
+// Montagem: o estado de um sistema de arquivos sobre um dispositivo do disco. Cada thread opera sobre a
+// montagem escolhida com fs_use, ou sobre a criada pelo fs_init se nao escolheu nenhuma;
+typedef struct fs_mount fs_mount;
+
+fs_mount *fs_mount_device(bl_device *dev);
+int fs_unmount(fs_mount *mount);
+void fs_use(fs_mount *mount);
 
 int fs_init();
-int fs_format();
-int fs_free();
+int fs_format(int cluster_size);
+long fs_free();
+int fs_statfs(fs_stats *stats);
+void fs_get_counters(fs_counters *counters);
+void fs_reset_counters();
+char *fs_op_name(int op);
 int fs_list(char *buffer, int size);
+int fs_list_next(int *cursor, char *file_name, int *size);
 int fs_create(char *file_name);
 int fs_remove(char *file_name);
+int fs_clone(char *src, char *dst);
 int fs_open(char *file_name, int mode);
 int fs_close(int file);
 int fs_write(char *buffer, int size, int file);
+int fs_fallocate(int file, int size);
 int fs_read(char *buffer, int size, int file);
+int fs_seek(int file, int offset);
+int fs_pread(int file, char *buffer, int size, int offset);
+int fs_fragmentation(char *file_name, fs_frag *frag);
+int fs_defrag_step(int clusters);
+int fs_defrag();
+int fs_set_commit_policy(int policy, int interval_ms);
+int fs_sync();
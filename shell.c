@@ -20,9 +20,17 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "disk.h"
 #include "fs.h"
@@ -31,16 +39,65 @@
 #define MAX_ARG 32
 #define COPY_BUFFER_SIZE 10
 
-void format();
+// Transferencias entre a maquina e a imagem: pedacos de PIPE_BUFFER bytes, alinhados ao setor, numa fila de
+// PIPE_DEPTH pedacos entre quem le e quem escreve;
+#define PIPE_BUFFER (1024 * 1024)
+#define PIPE_DEPTH 4
+#define PIPE_NAME 4096
+
+// Tipos de pedaco: inicio de um arquivo, com o nome do destino e o tamanho esperado, dados, fim do arquivo,
+// fim da transferencia e fim de um arquivo que nao pode ser lido inteiro, com o nome do destino incompleto;
+#define CHUNK_BEGIN 0
+#define CHUNK_DATA 1
+#define CHUNK_END 2
+#define CHUNK_STOP 3
+#define CHUNK_FAIL 4
+
+typedef struct {
+  int kind;
+  int size;
+  char *data;
+  char name[PIPE_NAME];
+} chunk;
+
+// Fila circular de pedacos entre um produtor e um consumidor, com a lista dos arquivos a transferir e o que
+// ja foi transferido. abort e ligado pelo consumidor quando o destino nao aceita mais dados;
+typedef struct {
+  chunk chunks[PIPE_DEPTH];
+  int head;
+  int count;
+  int abort;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+
+  char **from;
+  char **to;
+  int files;
+  int done;
+  long bytes;
+} pipeline;
+
+void format(char *cluster_kb);
 void list();
 void create(char *file);
 void fremove(char *file);
 void copy(char *file1, char *file2);
+void clone(char *file1, char *file2);
 void copyf(char *file1, char *file2);
 void copyt(char *file1, char *file2);
+void import(char *dir);
+void export(char *dir);
+void transfer(char **from, char **to, int files, int import, int report);
+void commit(char *policy);
+void stats(char *reset);
+void frag(char *file);
+void frag_line(char *name, fs_frag *f);
+void defrag(char *clusters);
+void histogram(char *name, bl_histogram *h, double divisor);
 
 int main(int argc, char **argv) {
   char *image;
+  char *backend;
   int size;
   char linha[MAX_STR];
   char *args[MAX_ARG + 1];
@@ -51,7 +108,7 @@ int main(int argc, char **argv) {
   if (argc >= 2 && argc <= 3) {
     image = argv[1];
     if (argc > 2) {
-      size = (atoi(argv[2]) * 1024 * 1024) / SECTORSIZE;
+      size = (int) ((long) atoi(argv[2]) * 1024 * 1024 / SECTORSIZE);
     }
   } else {
     printf("Uso: %s imagem [tamanho]\n", argv[0]);
@@ -60,11 +117,27 @@ int main(int argc, char **argv) {
     exit(0);
   }
 
+  // O backend de disco pode ser escolhido pela variavel de ambiente RSFS_BACKEND;
+  backend = getenv("RSFS_BACKEND");
+  if (backend != NULL) {
+    if (!strcmp(backend, "stdio")) {
+      bl_set_backend(BL_STDIO);
+    } else if (!strcmp(backend, "mmap")) {
+      bl_set_backend(BL_MMAP);
+    } else if (!strcmp(backend, "pread")) {
+      bl_set_backend(BL_PREAD);
+    } else if (!strcmp(backend, "direct")) {
+      bl_set_backend(BL_DIRECT);
+    } else {
+      printf("Backend %s desconhecido, usando o padrão.\n", backend);
+    }
+  }
+
   if (!bl_init(image, size)) {
     exit(0);
   }
   printf("Arquivo de imagem %s aberto.\n", image);
-  printf("Tamanho %d setores (%d bytes).\n", bl_size(), bl_size() * SECTORSIZE);
+  printf("Tamanho %d setores (%ld bytes).\n", bl_size(), (long) bl_size() * SECTORSIZE);
   
   if (!fs_init()) {
     exit(0);
@@ -93,9 +166,14 @@ int main(int argc, char **argv) {
     }
 
     if (!strcmp(args[0], "exit")) {
+      fs_sync();
       exit(EXIT_SUCCESS);
     } else if (!strcmp(args[0], "format")) {
-      format();
+      if (i <= 2) {
+	format(args[1]);
+      } else {
+	printf("Uso: format [cluster em KB]\n");
+      }
     } else if (!strcmp(args[0], "list")) {
       list();
     } else if (!strcmp(args[0], "create")) {
@@ -116,6 +194,12 @@ int main(int argc, char **argv) {
       } else {
 	printf("Uso: copy <file1> <file2>\n");
       }
+    } else if (!strcmp(args[0], "clone")) {
+      if (i == 3) {
+	clone(args[1], args[2]);
+      } else {
+	printf("Uso: clone <file1> <file2>\n");
+      }
     } else if (!strcmp(args[0], "copyf")) {
       if (i == 3) {
 	copyf(args[1], args[2]);
@@ -128,24 +212,67 @@ int main(int argc, char **argv) {
       } else {
 	printf("Uso: copyt <file> <real_file>\n");
       }
+    } else if (!strcmp(args[0], "import")) {
+      if (i == 2) {
+	import(args[1]);
+      } else {
+	printf("Uso: import <real_dir>\n");
+      }
+    } else if (!strcmp(args[0], "export")) {
+      if (i == 2) {
+	export(args[1]);
+      } else {
+	printf("Uso: export <real_dir>\n");
+      }
+    } else if (!strcmp(args[0], "commit")) {
+      if (i == 2) {
+	commit(args[1]);
+      } else {
+	printf("Uso: commit cluster|close|<ms>\n");
+      }
+    } else if (!strcmp(args[0], "stats")) {
+      if (i == 1 || (i == 2 && !strcmp(args[1], "reset"))) {
+	stats(args[1]);
+      } else {
+	printf("Uso: stats [reset]\n");
+      }
+    } else if (!strcmp(args[0], "frag")) {
+      if (i <= 2) {
+	frag(args[1]);
+      } else {
+	printf("Uso: frag [file]\n");
+      }
+    } else if (!strcmp(args[0], "defrag")) {
+      if (i <= 2) {
+	defrag(args[1]);
+      } else {
+	printf("Uso: defrag [clusters]\n");
+      }
     } else {
       printf("Comando inválido\n");
     }
   }
 }
 
-void format() {
-  if (fs_format()) {
-    printf("Formatação concluída. %d bytes livres.\n", fs_free());
+void format(char *cluster_kb) {
+  int cluster_size = FS_CLUSTER_DEFAULT;
+  if (cluster_kb != NULL) cluster_size = atoi(cluster_kb) * 1024;
+  if (fs_format(cluster_size)) {
+    printf("Formatação concluída. %ld bytes livres.\n", fs_free());
   }
 }
 
 void list() {
-  char buffer[4096];
-  if (fs_list(buffer, 4096)) {
-    printf("%s", buffer);
-    printf("%d bytes livres.\n", fs_free());
+  char name[25];
+  int size;
+  int cursor = 0;
+  if (fs_free() == -1) {
+    return;
   }
+  while (fs_list_next(&cursor, name, &size)) {
+    printf("%s\t\t%d\n", name, size);
+  }
+  printf("%ld bytes livres.\n", fs_free());
 }
 
 void create(char *file) {
@@ -181,61 +308,441 @@ void copy(char *file1, char *file2) {
   fs_close(fd2);
 }
 
+void clone(char *file1, char *file2) {
+  fs_clone(file1, file2);
+}
+
 void copyf(char *file1, char *file2) {
-  int fd2;
-  char buffer[COPY_BUFFER_SIZE];
-  FILE *stream;
-  int read;
+  transfer(&file1, &file2, 1, 1, 0);
+}
+
+void copyt(char *file1, char *file2) {
+  transfer(&file1, &file2, 1, 0, 0);
+}
+
+// Funcao auxiliar que acrescenta uma copia de um nome a uma lista que cresce conforme a demanda. Retorna 0
+// se faltou memoria, com a lista como estava;
+int push_name(char ***lista, int *count, int *cap, char *nome) {
+  if (*count == *cap) {
+    int novo = *cap == 0 ? 64 : *cap * 2;
+    char **l = realloc(*lista, novo * sizeof(char *));
+    if (l == NULL) {
+      perror("Alocando lista de arquivos");
+      return 0;
+    }
+    *lista = l;
+    *cap = novo;
+  }
+  char *copia = strdup(nome);
+  if (copia == NULL) {
+    perror("Alocando lista de arquivos");
+    return 0;
+  }
+  (*lista)[(*count)++] = copia;
+  return 1;
+}
+
+// Funcao auxiliar que libera as listas de nomes de uma importacao ou exportacao;
+void free_names(char **from, int count_from, char **to, int count_to) {
+  for (int i = 0; i < count_from; i++) {
+    free(from[i]);
+  }
+  for (int i = 0; i < count_to; i++) {
+    free(to[i]);
+  }
+  free(from);
+  free(to);
+}
 
-  stream = fopen(file1, "r");
-  if (stream == NULL) {
-    perror("Abrindo arquivo real para cópia (leitura)");
+void import(char *dir) {
+  char **from = NULL, **to = NULL;
+  int files = 0, count_from = 0, cap_from = 0, cap_to = 0;
+  char caminho[PIPE_NAME];
+  struct dirent *e;
+  struct stat sb;
+
+  DIR *d = opendir(dir);
+  if (d == NULL) {
+    perror("Abrindo diretório real para importação");
     return;
   }
+  // Os arquivos regulares do diretorio entram na imagem com o mesmo nome. Sem memoria para as listas nada e
+  // importado;
+  int ok = 1;
+  while (ok && (e = readdir(d)) != NULL) {
+    snprintf(caminho, PIPE_NAME, "%s/%s", dir, e->d_name);
+    if (stat(caminho, &sb) == -1 || !S_ISREG(sb.st_mode)) continue;
+    ok = push_name(&from, &count_from, &cap_from, caminho) && push_name(&to, &files, &cap_to, e->d_name);
+  }
+  closedir(d);
 
-  if ((fd2 = fs_open(file2, FS_W)) == -1) {
-    fclose(stream);
+  if (ok) transfer(from, to, files, 1, 1);
+  free_names(from, count_from, to, files);
+}
+
+void export(char *dir) {
+  char **from = NULL, **to = NULL;
+  int files = 0, count_from = 0, cap_from = 0, cap_to = 0;
+  char caminho[PIPE_NAME];
+  char name[25];
+  int size;
+  int cursor = 0;
+
+  if (fs_free() == -1) {
+    return;
+  }
+  if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+    perror("Criando diretório real para exportação");
     return;
   }
+  // Todos os arquivos da imagem vao para o diretorio com o mesmo nome. Nomes que levariam para fora dele, com
+  // uma barra ou que sao . e .., ficam de fora. Sem memoria para as listas nada e exportado;
+  int ok = 1;
+  while (ok && fs_list_next(&cursor, name, &size)) {
+    if (strchr(name, '/') != NULL || !strcmp(name, ".") || !strcmp(name, "..")) {
+      printf("Arquivo %s não pode ser exportado com esse nome, ignorado!⚠⚠⚠⚠⚠\n", name);
+      continue;
+    }
+    snprintf(caminho, PIPE_NAME, "%s/%s", dir, name);
+    ok = push_name(&from, &count_from, &cap_from, name) && push_name(&to, &files, &cap_to, caminho);
+  }
 
-  while ((read = fread(buffer, sizeof(char), COPY_BUFFER_SIZE, stream)) > 0) {
-    if (fs_write(buffer, read, fd2) != read) {
-      fclose(stream);
-      fs_close(fd2);
+  if (ok) transfer(from, to, files, 0, 1);
+  free_names(from, count_from, to, files);
+}
+
+// Funcao auxiliar que espera um pedaco livre na fila e o devolve para ser preenchido pelo produtor;
+chunk *pipe_reserve(pipeline *p) {
+  pthread_mutex_lock(&p->lock);
+  while (p->count == PIPE_DEPTH) {
+    pthread_cond_wait(&p->changed, &p->lock);
+  }
+  chunk *c = &p->chunks[(p->head + p->count) % PIPE_DEPTH];
+  pthread_mutex_unlock(&p->lock);
+  return c;
+}
+
+// Funcao auxiliar que entrega ao consumidor o pedaco reservado;
+void pipe_publish(pipeline *p) {
+  pthread_mutex_lock(&p->lock);
+  p->count++;
+  pthread_cond_broadcast(&p->changed);
+  pthread_mutex_unlock(&p->lock);
+}
+
+// Funcao auxiliar que espera o proximo pedaco da fila, na ordem em que foram entregues;
+chunk *pipe_next(pipeline *p) {
+  pthread_mutex_lock(&p->lock);
+  while (p->count == 0) {
+    pthread_cond_wait(&p->changed, &p->lock);
+  }
+  chunk *c = &p->chunks[p->head];
+  pthread_mutex_unlock(&p->lock);
+  return c;
+}
+
+// Funcao auxiliar que devolve ao produtor o pedaco ja consumido;
+void pipe_release(pipeline *p) {
+  pthread_mutex_lock(&p->lock);
+  p->head = (p->head + 1) % PIPE_DEPTH;
+  p->count--;
+  pthread_cond_broadcast(&p->changed);
+  pthread_mutex_unlock(&p->lock);
+}
+
+// Funcao auxiliar que entrega um pedaco sem dados, de inicio ou fim de arquivo ou de fim da transferencia.
+// No inicio de um arquivo size leva o tamanho esperado, ou 0 se nao e conhecido;
+void pipe_mark(pipeline *p, int kind, char *name, int size) {
+  chunk *c = pipe_reserve(p);
+  c->kind = kind;
+  c->size = size;
+  if (name != NULL) snprintf(c->name, PIPE_NAME, "%s", name);
+  pipe_publish(p);
+}
+
+// Funcao auxiliar pela qual o consumidor pede que o produtor pare, quando o destino nao aceita mais dados;
+void pipe_abort(pipeline *p) {
+  pthread_mutex_lock(&p->lock);
+  p->abort = 1;
+  pthread_mutex_unlock(&p->lock);
+}
+
+int pipe_aborted(pipeline *p) {
+  pthread_mutex_lock(&p->lock);
+  int r = p->abort;
+  pthread_mutex_unlock(&p->lock);
+  return r;
+}
+
+// Produtor da importacao: le os arquivos reais em pedacos de PIPE_BUFFER bytes;
+void *host_reader(void *arg) {
+  pipeline *p = arg;
+  for (int i = 0; i < p->files && !pipe_aborted(p); i++) {
+    int fd = open(p->from[i], O_RDONLY);
+    if (fd == -1) {
+      perror("Abrindo arquivo real para cópia (leitura)");
+      continue;
+    }
+    // O tamanho do arquivo real segue no inicio, para a imagem reservar os clusters de uma vez;
+    struct stat st;
+    int size = fstat(fd, &st) == 0 && st.st_size <= INT_MAX ? (int) st.st_size : 0;
+    pipe_mark(p, CHUNK_BEGIN, p->to[i], size);
+    int lido = 0;
+    while (!pipe_aborted(p)) {
+      chunk *c = pipe_reserve(p);
+      lido = read(fd, c->data, PIPE_BUFFER);
+      if (lido <= 0) {
+        if (lido == -1) perror("Lendo arquivo real");
+        break;
+      }
+      c->kind = CHUNK_DATA;
+      c->size = lido;
+      pipe_publish(p);
+    }
+    close(fd);
+    pipe_mark(p, lido == -1 ? CHUNK_FAIL : CHUNK_END, p->to[i], 0);
+  }
+  pipe_mark(p, CHUNK_STOP, NULL, 0);
+  return NULL;
+}
+
+// Consumidor da importacao: escreve os pedacos nos arquivos da imagem. Um arquivo que nao pode ser lido
+// inteiro e removido da imagem e seus bytes saem da contagem;
+void *image_writer(void *arg) {
+  pipeline *p = arg;
+  int fd = -1;
+  long escritos = 0;
+  while (1) {
+    chunk *c = pipe_next(p);
+    if (c->kind == CHUNK_STOP) break;
+    if (c->kind == CHUNK_BEGIN) {
+      fd = fs_open(c->name, FS_W);
+      if (fd != -1 && c->size > 0) fs_fallocate(fd, c->size);
+      escritos = 0;
+    } else if (c->kind == CHUNK_DATA && fd != -1) {
+      if (fs_write(c->data, c->size, fd) != c->size) {
+        fs_close(fd);
+        fd = -1;
+        pipe_abort(p);
+      } else {
+        p->bytes += c->size;
+        escritos += c->size;
+      }
+    } else if (c->kind == CHUNK_END && fd != -1) {
+      if (fs_close(fd)) {
+        p->done++;
+      } else {
+        pipe_abort(p);
+      }
+      fd = -1;
+    } else if (c->kind == CHUNK_FAIL && fd != -1) {
+      fs_close(fd);
+      fs_remove(c->name);
+      printf("Arquivo %s incompleto, removido da imagem!⚠⚠⚠⚠⚠\n", c->name);
+      p->bytes -= escritos;
+      fd = -1;
+    }
+    pipe_release(p);
+  }
+  return NULL;
+}
+
+// Produtor da exportacao: le os arquivos da imagem em pedacos de PIPE_BUFFER bytes;
+void *image_reader(void *arg) {
+  pipeline *p = arg;
+  for (int i = 0; i < p->files && !pipe_aborted(p); i++) {
+    int fd = fs_open(p->from[i], FS_R);
+    if (fd == -1) continue;
+    pipe_mark(p, CHUNK_BEGIN, p->to[i], 0);
+    int lido = 0;
+    while (!pipe_aborted(p)) {
+      chunk *c = pipe_reserve(p);
+      lido = fs_read(c->data, PIPE_BUFFER, fd);
+      if (lido <= 0) break;
+      c->kind = CHUNK_DATA;
+      c->size = lido;
+      pipe_publish(p);
+    }
+    fs_close(fd);
+    pipe_mark(p, lido == -1 ? CHUNK_FAIL : CHUNK_END, p->to[i], 0);
+  }
+  pipe_mark(p, CHUNK_STOP, NULL, 0);
+  return NULL;
+}
+
+// Consumidor da exportacao: escreve os pedacos nos arquivos reais. Um arquivo que nao pode ser lido inteiro
+// da imagem e apagado da maquina e seus bytes saem da contagem;
+void *host_writer(void *arg) {
+  pipeline *p = arg;
+  int fd = -1;
+  long escritos = 0;
+  while (1) {
+    chunk *c = pipe_next(p);
+    if (c->kind == CHUNK_STOP) break;
+    if (c->kind == CHUNK_BEGIN) {
+      fd = open(c->name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd == -1) perror("Abrindo arquivo real para cópia (escrita)");
+      escritos = 0;
+    } else if (c->kind == CHUNK_DATA && fd != -1) {
+      if (write(fd, c->data, c->size) != c->size) {
+        perror("Escrevendo arquivo real");
+        close(fd);
+        fd = -1;
+        pipe_abort(p);
+      } else {
+        p->bytes += c->size;
+        escritos += c->size;
+      }
+    } else if (c->kind == CHUNK_END && fd != -1) {
+      if (close(fd) == 0) p->done++;
+      fd = -1;
+    } else if (c->kind == CHUNK_FAIL && fd != -1) {
+      close(fd);
+      unlink(c->name);
+      printf("Arquivo %s incompleto, removido!⚠⚠⚠⚠⚠\n", c->name);
+      p->bytes -= escritos;
+      fd = -1;
+    }
+    pipe_release(p);
+  }
+  return NULL;
+}
+
+// Transfere files arquivos entre a maquina e a imagem, de from para to, num sentido ou no outro. O lado da
+// maquina roda numa thread propria e o da imagem na thread do shell, que tem a montagem, entao a leitura de
+// um lado se sobrepoe a escrita do outro atraves da fila de pedacos;
+void transfer(char **from, char **to, int files, int import, int report) {
+  pipeline p;
+  pthread_t thread;
+  struct timespec inicio, fim;
+
+  memset(&p, 0, sizeof(pipeline));
+  p.from = from;
+  p.to = to;
+  p.files = files;
+  pthread_mutex_init(&p.lock, NULL);
+  pthread_cond_init(&p.changed, NULL);
+  for (int i = 0; i < PIPE_DEPTH; i++) {
+    if (posix_memalign((void **) &p.chunks[i].data, SECTORSIZE, PIPE_BUFFER) != 0) {
+      printf("Sem memória para a transferência!\n");
+      for (int j = 0; j < i; j++) {
+        free(p.chunks[j].data);
+      }
       return;
     }
   }
 
-  fclose(stream);
-  fs_close(fd2);
+  clock_gettime(CLOCK_MONOTONIC, &inicio);
+  if (pthread_create(&thread, NULL, import ? host_reader : host_writer, &p) != 0) {
+    printf("Não foi possível criar a thread de transferência!\n");
+  } else {
+    if (import) {
+      image_writer(&p);
+    } else {
+      image_reader(&p);
+    }
+    pthread_join(thread, NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &fim);
+
+  // Os comandos de diretorio informam o que foi feito;
+  if (report) {
+    double segundos = (fim.tv_sec - inicio.tv_sec) + (fim.tv_nsec - inicio.tv_nsec) / 1e9;
+    printf("%d de %d arquivos transferidos, %ld bytes em %.2f s (%.1f MB/s).\n", p.done, files, p.bytes,
+           segundos, segundos > 0 ? p.bytes / segundos / (1024 * 1024) : 0);
+  }
+  for (int i = 0; i < PIPE_DEPTH; i++) {
+    free(p.chunks[i].data);
+  }
+  pthread_mutex_destroy(&p.lock);
+  pthread_cond_destroy(&p.changed);
 }
 
-void copyt(char *file1, char *file2) {
-  int fd1;
-  char buffer[COPY_BUFFER_SIZE];
-  FILE *stream;
-  int read;
+void commit(char *policy) {
+  if (!strcmp(policy, "cluster")) {
+    fs_set_commit_policy(FS_COMMIT_CLUSTER, 0);
+  } else if (!strcmp(policy, "close")) {
+    fs_set_commit_policy(FS_COMMIT_CLOSE, 0);
+  } else {
+    fs_set_commit_policy(FS_COMMIT_INTERVAL, atoi(policy));
+  }
+}
 
-  if ((fd1 = fs_open(file1, FS_R)) == -1) {
+// Imprime uma linha com a contagem, a media e os percentis 50 e 99 de um histograma. Os percentis sao o
+// limite superior do balde logaritmico onde caem; divisor converte os valores para a unidade impressa;
+void histogram(char *name, bl_histogram *h, double divisor) {
+  printf("%-12s %10ld %12.1f %12.1f %12.1f\n", name, h->count,
+         h->count > 0 ? h->sum / divisor / h->count : 0,
+         bl_histogram_percentile(h, 50) / divisor, bl_histogram_percentile(h, 99) / divisor);
+}
+
+void stats(char *reset) {
+  bl_io_stats io;
+  bl_cache_stats cache;
+  fs_counters counters;
+
+  if (reset != NULL) {
+    bl_io_reset_stats();
+    fs_reset_counters();
     return;
   }
+  bl_io_get_stats(&io);
+  bl_cache_get_stats(&cache);
+  fs_get_counters(&counters);
 
-  stream = fopen(file2, "w+");
-  if (stream == NULL) {
-    perror("Abrindo arquivo real para cópia (escrita)");
-    fs_close(fd1);
+  printf("Disco: %ld leituras (%ld setores), %ld escritas (%ld setores), %ld syncs.\n",
+         io.reads, io.sectors_read, io.writes, io.sectors_written, io.syncs);
+  printf("Cache: %ld acertos, %ld faltas, %ld despejos, %ld escritas adiadas.\n",
+         cache.hits, cache.misses, cache.evictions, cache.writebacks);
+  printf("Metadados: %ld setores escritos no lugar.\n", counters.flushed_sectors);
+  printf("Latências em us:\n");
+  printf("%-12s %10s %13s %12s %12s\n", "", "n", "média", "p50", "p99");
+  histogram("bl_read", &io.read_latency, 1000);
+  histogram("bl_write", &io.write_latency, 1000);
+  histogram("bl_sync", &io.sync_latency, 1000);
+  histogram("flush", &counters.flushes, 1000);
+  histogram("commit", &counters.commits, 1000);
+  for (int op = 0; op < FS_OPS; op++) {
+    if (counters.ops[op].count > 0) histogram(fs_op_name(op), &counters.ops[op], 1000);
+  }
+  printf("Entradas da fat examinadas por alocação:\n");
+  histogram("alocador", &counters.alloc_scan, 1);
+}
+
+// Imprime os numeros de uma medida de fragmentacao, com o comprimento medio dos trechos contiguos;
+void frag_line(char *name, fs_frag *f) {
+  printf("%-24s %10ld %8ld %10.1f\n", name, f->clusters, f->extents,
+         f->extents > 0 ? (double) f->clusters / f->extents : 0);
+}
+
+void frag(char *file) {
+  fs_frag f;
+  char name[25];
+  int size;
+  int cursor = 0;
+
+  printf("%-24s %10s %8s %10s\n", "", "clusters", "extents", "média");
+  if (file != NULL) {
+    if (fs_fragmentation(file, &f)) frag_line(file, &f);
     return;
   }
+  if (!fs_fragmentation(NULL, &f)) return;
 
-  while ((read = fs_read(buffer, COPY_BUFFER_SIZE, fd1)) > 0) {
-    if (fwrite(buffer, sizeof(char), read, stream) != read) {
-      perror("Escrevendo arquivo real");
-      fs_close(fd1);
-      fclose(stream);
-      return;
-    }
+  // Os arquivos fragmentados um a um, depois o volume inteiro;
+  while (fs_list_next(&cursor, name, &size)) {
+    fs_frag arquivo;
+    if (fs_fragmentation(name, &arquivo) && arquivo.extents > 1) frag_line(name, &arquivo);
   }
+  frag_line("(volume)", &f);
+  printf("%d de %d arquivos fragmentados, até %d extents em um arquivo.\n", f.fragmented_files, f.files,
+         f.max_extents);
+}
 
-  fs_close(fd1);
-  fclose(stream);
+void defrag(char *clusters) {
+  // Sem argumento desfragmenta tudo; com um numero move no maximo esse tanto de clusters e para, e o proximo
+  // defrag continua de onde este parou;
+  int movidos = clusters == NULL ? fs_defrag() : fs_defrag_step(atoi(clusters));
+  if (movidos == -1) return;
+  printf("%d clusters movidos.\n", movidos);
+  frag(NULL);
 }